@@ -55,12 +55,22 @@
 /* 
  * Alignment requirement in bytes (either 4 or 8) 
  */
+#ifdef MM_PRELOAD
+/* what the C library's malloc promises on x86-64, which programs count on */
+#define ALIGNMENT 16
+#else
 #define ALIGNMENT 8  
+#endif
 
 /* 
  * Maximum heap size in bytes 
  */
+#ifdef MM_PRELOAD
+/* libmm.so only reserves address space, which memlib commits as the heap grows */
+#define MAX_HEAP ((size_t)1 << (sizeof(size_t) > 4 ? 40 : 30))
+#else
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
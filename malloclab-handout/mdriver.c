@@ -15,6 +15,8 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -30,6 +32,13 @@
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* Hot-size benchmark (-B) */
+#define PAIR_ITERS  1000000 /* malloc/free pairs per thread */
+#define PAIR_SLOTS        8 /* blocks each thread keeps live (a power of 2) */
+
+/* Bulk node benchmark (-N) */
+#define NODE_TOTAL  4000000 /* nodes allocated and freed per size */
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
 
@@ -46,9 +55,10 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    enum {ALLOC, FREE, REALLOC, MEMALIGN, CALLOC} type; /* type of request */
     int index;                        /* index for free() to use later */
     int size;                         /* byte size of alloc/realloc request */
+    int align;                        /* alignment of a memalign request */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -81,6 +91,9 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    size_t peak_heap; /* largest heap size while running the trace */
+    size_t end_heap;  /* heap size once the trace is done */
+    mm_stats_t counters; /* mm_stats after the utilization pass */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -122,11 +135,31 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   stats_t *stats);
 static void eval_mm_speed(void *ptr);
 
+/* Routines for the multi-threaded replay (-P) */
+static void *replay_thread(void *ptr);
+static double eval_mm_parallel(trace_t *trace, int nthreads);
+
+/* Routines for the hot-size malloc/free benchmark (-B) */
+static void *pairs_thread(void *ptr);
+static void eval_mm_pairs(int maxthreads);
+
+/* Routines for the bulk node benchmark (-N) */
+static double node_rounds(int nodes, int size, int batch);
+static void eval_mm_nodes(int nodes);
+
+/* Self-checks for movable blocks (-H) and regions (-R) */
+static size_t handle_size(int i);
+static void check_bytes(char *p, int c, size_t size, char *msg);
+static void eval_mm_handles(int n);
+static void eval_mm_regions(int n);
+
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printcounters(int n, stats_t *stats);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -150,6 +183,12 @@ int main(int argc, char **argv)
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int nthreads = 0;    /* If set, also replay each trace in this many threads (-P) */
+    double *par_secs = NULL; /* secs for the multi-threaded replay of each trace */
+    int pair_threads = 0; /* If set, run the hot-size benchmark up to this many threads (-B) */
+    int batch_nodes = 0;  /* If set, run the bulk node benchmark with this many nodes (-N) */
+    int handle_blocks = 0; /* If set, check mm_compact with this many handles (-H) */
+    int region_blocks = 0; /* If set, check regions with this many blocks (-R) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +197,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:P:B:N:M:H:R:hvVgal")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -184,6 +223,44 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+	case 'B': /* Hot-size malloc/free benchmark in 1, 2, 4, ... threads */
+	    pair_threads = atoi(optarg);
+	    if (pair_threads < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'N': /* Bulk node benchmark, singly vs. mm_malloc_batch */
+	    batch_nodes = atoi(optarg);
+	    if (batch_nodes < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'H': /* Check handle blocks and mm_compact */
+	    handle_blocks = atoi(optarg);
+	    if (handle_blocks < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'R': /* Check regions */
+	    region_blocks = atoi(optarg);
+	    if (region_blocks < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'M': /* Make mem_map fail past this many mapped bytes */
+	    mem_set_map_limit(strtoul(optarg, NULL, 0));
+	    break;
+	case 'P': /* Replay each trace in this many threads at once */
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1) {
+		usage();
+		exit(1);
+	    }
+	    break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -225,6 +302,28 @@ int main(int argc, char **argv)
 	    printf("Member 2 :%s:%s\n", team.name2, team.id2);
     }
 
+    /*
+     * The hot-size benchmark stands on its own, without any traces
+     */
+    if (pair_threads) {
+	mem_init();
+	eval_mm_pairs(pair_threads);
+	exit(0);
+    }
+    if (batch_nodes) {
+	mem_init();
+	eval_mm_nodes(batch_nodes);
+	exit(0);
+    }
+    if (handle_blocks || region_blocks) {
+	mem_init();
+	if (handle_blocks)
+	    eval_mm_handles(handle_blocks);
+	if (region_blocks)
+	    eval_mm_regions(region_blocks);
+	exit(0);
+    }
+
     /* 
      * If no -f command line arg, then use the entire set of tracefiles 
      * defined in default_traces[]
@@ -283,6 +382,8 @@ int main(int argc, char **argv)
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
+    if (nthreads && (par_secs = (double *)calloc(num_tracefiles, sizeof(double))) == NULL)
+	unix_error("par_secs calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
@@ -297,12 +398,14 @@ int main(int argc, char **argv)
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_stats[i].util = eval_mm_util(trace, i, &ranges, &mm_stats[i]);
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
 	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (nthreads)
+		par_secs[i] = eval_mm_parallel(trace, nthreads);
 	}
 	free_trace(trace);
     }
@@ -312,6 +415,35 @@ int main(int argc, char **argv)
 	printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
+
+	/* Peak and ending heap sizes, to show what trimming gave back */
+	printf("Heap footprint (KB):\n");
+	printf("%5s%10s%10s\n", "trace", "peak", "end");
+	for (i=0; i < num_tracefiles; i++) {
+	    if (mm_stats[i].valid)
+		printf("%2d%13.1f%10.1f\n", i,
+		       mm_stats[i].peak_heap / 1024.0,
+		       mm_stats[i].end_heap / 1024.0);
+	}
+	printf("\n");
+
+	/* What mm.c did on the way, from mm_stats */
+	printf("Allocator counters (utilization pass):\n");
+	printcounters(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+
+    /* Display the multi-threaded replay, counting every thread's ops */
+    if (nthreads) {
+	printf("Replay in %d threads:\n", nthreads);
+	printf("%5s%10s%10s%8s\n", "trace", "ops", "secs", "Kops");
+	for (i=0; i < num_tracefiles; i++) {
+	    if (mm_stats[i].valid)
+		printf("%2d%13.0f%10.6f%8.0f\n", i,
+		       mm_stats[i].ops * nthreads, par_secs[i],
+		       (mm_stats[i].ops * nthreads / 1e3) / par_secs[i]);
+	}
+	printf("\n");
     }
 
     /* 
@@ -395,9 +527,10 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap (or a mapping) */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_in_map(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -477,7 +610,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, align;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -534,6 +667,25 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
+	case 'c':
+	    fscanf(tracefile, "%u %u", &index, &size);
+	    trace->ops[op_index].type = CALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'm':
+	    fscanf(tracefile, "%u %u %u", &index, &size, &align);
+	    if (align == 0 || (align & (align - 1)) != 0) {
+		printf("Bogus alignment (%u) in tracefile %s\n", align, path);
+		exit(1);
+	    }
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].align = align;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
@@ -629,6 +781,44 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    trace->block_sizes[index] = size;
 	    break;
 
+        case CALLOC: /* mm_calloc */
+
+	    if ((p = mm_calloc(1, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_calloc failed.");
+		return 0;
+	    }
+	    for (j = 0; j < size; j++) {
+		if (p[j] != 0) {
+		    malloc_error(tracenum, i, "mm_calloc did not zero the block");
+		    return 0;
+		}
+	    }
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		return 0;
+	    memset(p, index & 0xFF, size);
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
+        case MEMALIGN: /* mm_memalign */
+
+	    if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_memalign failed.");
+		return 0;
+	    }
+	    if ((unsigned long)p % trace->ops[i].align != 0) {
+		sprintf(msg, "mm_memalign payload (%p) not aligned to %d bytes",
+			p, trace->ops[i].align);
+		malloc_error(tracenum, i, msg);
+		return 0;
+	    }
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		return 0;
+	    memset(p, index & 0xFF, size);
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
         case REALLOC: /* mm_realloc */
 	    
 	    /* Call the student's realloc */
@@ -653,7 +843,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -666,12 +856,22 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    trace->block_sizes[index] = size;
 	    break;
 
-        case FREE: /* mm_free */
+        case FREE: /* mm_free, or mm_free_sized every other time */
 	    
-	    /* Remove region from list and call student's free function */
+	    /* The block must hold at least what was asked for */
 	    p = trace->blocks[index];
+	    if (mm_usable_size(p) < trace->block_sizes[index]) {
+		malloc_error(tracenum, i, "mm_usable_size is less than the "
+			     "size of the block");
+		return 0;
+	    }
+
+	    /* Remove region from list and call student's free function */
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    if (i % 2)
+		mm_free_sized(p, trace->block_sizes[index]);
+	    else
+		mm_free(p);
 	    break;
 
 	default:
@@ -689,13 +889,15 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   peak size of the heap in bytes, counting regions from mem_map,
+ *   while running the student's malloc package on the trace. The
+ *   package may give memory back by decrementing the brk pointer or
+ *   unmapping, so the peak and the ending heap sizes are both recorded
+ *   in stats.
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   stats_t *stats)
 {   
     int i;
     int index;
@@ -733,6 +935,32 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 		total_size : max_total_size;
 	    break;
 
+        case CALLOC: /* mm_calloc */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+
+	    if ((p = mm_calloc(1, size)) == NULL) 
+		app_error("mm_calloc failed in eval_mm_util");
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    total_size += size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+        case MEMALIGN: /* mm_memalign */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+
+	    if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) 
+		app_error("mm_memalign failed in eval_mm_util");
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    total_size += size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
 	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
@@ -774,7 +1002,10 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    stats->peak_heap = mem_peak_footprint();
+    stats->end_heap = mem_heapsize() + mem_mapsize();
+    mm_stats(&stats->counters);
+    return ((double)max_total_size / (double)mem_peak_footprint());
 }
 
 
@@ -805,6 +1036,22 @@ static void eval_mm_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case CALLOC: /* mm_calloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_calloc(1, size)) == NULL)
+		app_error("mm_calloc error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+		app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
 	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -825,6 +1072,375 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * replay_thread - One thread of the -P replay. Runs the whole trace
+ *     against mm.c, keeping its own copy of the block pointers.
+ */
+static void *replay_thread(void *ptr)
+{
+    int i, index;
+    char *p;
+    trace_t *trace = (trace_t *)ptr;
+    char **blocks = calloc(trace->num_ids, sizeof(char *));
+
+    if (blocks == NULL)
+	unix_error("calloc failed in replay_thread");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+		app_error("mm_malloc error in replay_thread");
+            blocks[index] = p;
+            break;
+
+        case CALLOC: /* mm_calloc */
+            if ((p = mm_calloc(1, trace->ops[i].size)) == NULL)
+		app_error("mm_calloc error in replay_thread");
+            blocks[index] = p;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            if ((p = mm_memalign(trace->ops[i].align, trace->ops[i].size)) == NULL)
+		app_error("mm_memalign error in replay_thread");
+            blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+            if ((p = mm_realloc(blocks[index], trace->ops[i].size)) == NULL)
+		app_error("mm_realloc error in replay_thread");
+            blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            mm_free(blocks[index]);
+            break;
+
+	default:
+	    app_error("Nonexistent request type in replay_thread");
+        }
+    }
+
+    free(blocks);
+    return NULL;
+}
+
+/*
+ * eval_mm_parallel - Replay the trace in nthreads threads at once on a
+ *     fresh heap and return the wall clock seconds it took. Only makes
+ *     sense for a thread-safe mm.c (make MMFLAGS=-DMULTI_ARENA=1).
+ */
+static double eval_mm_parallel(trace_t *trace, int nthreads)
+{
+    int i;
+    struct timeval start, end;
+    pthread_t *tids = malloc(nthreads * sizeof(pthread_t));
+
+    if (tids == NULL)
+	unix_error("malloc failed in eval_mm_parallel");
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_parallel");
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < nthreads; i++)
+	if (pthread_create(&tids[i], NULL, replay_thread, trace) != 0)
+	    unix_error("pthread_create failed in eval_mm_parallel");
+    for (i = 0; i < nthreads; i++)
+	pthread_join(tids[i], NULL);
+    gettimeofday(&end, NULL);
+
+    free(tids);
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+/*
+ * pairs_thread - One thread of the -B benchmark. Does PAIR_ITERS
+ *     malloc/free pairs on a handful of small sizes, keeping the last
+ *     PAIR_SLOTS blocks live.
+ */
+static void *pairs_thread(void *ptr)
+{
+    static const int sizes[] = {16, 24, 32, 48, 64, 96, 128, 200};
+    char *live[PAIR_SLOTS] = {NULL};
+    int i, slot;
+
+    for (i = 0; i < PAIR_ITERS; i++) {
+	slot = i & (PAIR_SLOTS - 1);
+	if (live[slot] != NULL)
+	    mm_free(live[slot]);
+	if ((live[slot] = mm_malloc(sizes[i % 8])) == NULL)
+	    app_error("mm_malloc error in pairs_thread");
+	*live[slot] = (char)i;
+    }
+    for (slot = 0; slot < PAIR_SLOTS; slot++)
+	mm_free(live[slot]);
+    return NULL;
+}
+
+/*
+ * eval_mm_pairs - Run pairs_thread in 1, 2, 4, ... (up to maxthreads)
+ *     threads at once, each time on a fresh heap, and print the time per
+ *     pair seen by one thread and the pairs per second of all of them.
+ */
+static void eval_mm_pairs(int maxthreads)
+{
+    int i, n;
+    double secs;
+    struct timeval start, end;
+    pthread_t *tids = malloc(maxthreads * sizeof(pthread_t));
+
+    if (tids == NULL)
+	unix_error("malloc failed in eval_mm_pairs");
+
+    printf("%7s%10s%10s%10s\n", "threads", "secs", "ns/pair", "Mpairs/s");
+    for (n = 1; n <= maxthreads; n *= 2) {
+	mem_reset_brk();
+	if (mm_init() < 0) 
+	    app_error("mm_init failed in eval_mm_pairs");
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < n; i++)
+	    if (pthread_create(&tids[i], NULL, pairs_thread, NULL) != 0)
+		unix_error("pthread_create failed in eval_mm_pairs");
+	for (i = 0; i < n; i++)
+	    pthread_join(tids[i], NULL);
+	gettimeofday(&end, NULL);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	printf("%7d%10.6f%10.1f%10.2f\n", n, secs, 
+	       secs * 1e9 / PAIR_ITERS, (double)n * PAIR_ITERS / secs / 1e6);
+    }
+    free(tids);
+}
+
+/*
+ * node_rounds - Allocate nodes blocks of size bytes, touch each, and
+ *     free them all, until NODE_TOTAL nodes have come and gone, either one
+ *     call per node or one mm_malloc_batch/mm_free_batch per round.
+ *     Returns the seconds it took.
+ */
+static double node_rounds(int nodes, int size, int batch)
+{
+    void **node = malloc(nodes * sizeof(void *));
+    struct timeval start, end;
+    int round, i;
+
+    if (node == NULL)
+	unix_error("malloc failed in node_rounds");
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in node_rounds");
+
+    gettimeofday(&start, NULL);
+    for (round = 0; round < NODE_TOTAL / nodes; round++) {
+	if (batch) {
+	    if (mm_malloc_batch(size, nodes, node) != nodes)
+		app_error("mm_malloc_batch error in node_rounds");
+	} else {
+	    for (i = 0; i < nodes; i++)
+		if ((node[i] = mm_malloc(size)) == NULL)
+		    app_error("mm_malloc error in node_rounds");
+	}
+	for (i = 0; i < nodes; i++)
+	    *(char *)node[i] = (char)i;
+	if (batch)
+	    mm_free_batch(node, nodes);
+	else
+	    for (i = 0; i < nodes; i++)
+		mm_free(node[i]);
+    }
+    gettimeofday(&end, NULL);
+
+    free(node);
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+/*
+ * eval_mm_nodes - Time node_rounds for a few node sizes, one call per
+ *     node against one batch call per round, and print the ns per node
+ *     of each.
+ */
+static void eval_mm_nodes(int nodes)
+{
+    static const int sizes[] = {16, 48, 128, 512};
+    int i, rounds = NODE_TOTAL / nodes;
+    double single, batch;
+
+    if (rounds < 1)
+	app_error("too many nodes for eval_mm_nodes");
+    printf("%7s%12s%12s%10s\n", "size", "ns/single", "ns/batch", "speedup");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+	single = node_rounds(nodes, sizes[i], 0);
+	batch = node_rounds(nodes, sizes[i], 1);
+	printf("%7d%12.1f%12.1f%10.2f\n", sizes[i], 
+	       single * 1e9 / ((double)rounds * nodes), 
+	       batch * 1e9 / ((double)rounds * nodes), single / batch);
+    }
+}
+
+/*
+ * handle_size - The payload size of handle i in eval_mm_handles
+ */
+static size_t handle_size(int i)
+{
+    return 8 + (i * 37) % 500;
+}
+
+/*
+ * check_bytes - Exit with msg unless the size bytes at p all hold c
+ */
+static void check_bytes(char *p, int c, size_t size, char *msg)
+{
+    size_t j;
+
+    for (j = 0; j < size; j++)
+	if ((unsigned char)p[j] != (c & 0xFF))
+	    app_error(msg);
+}
+
+/*
+ * eval_mm_handles - Allocate n handle blocks, the first half of them
+ *     between blocks from mm_malloc that must stay put. Free every other
+ *     handle and pin every eighth of the rest, compact, and check that
+ *     every payload survived and no pinned block moved. Then refill the
+ *     holes with new handles and do it again.
+ */
+static void eval_mm_handles(int n)
+{
+    mm_handle_t *h = calloc(n, sizeof(mm_handle_t));
+    char **pinned = calloc(n, sizeof(char *));
+    char **plain = calloc(n, sizeof(char *));
+    size_t compacted = 0;
+    int i, pass;
+    char *p;
+
+    if (h == NULL || pinned == NULL || plain == NULL)
+	unix_error("calloc failed in eval_mm_handles");
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_handles");
+
+    for (i = 0; i < n; i++) {
+	if ((h[i] = mm_halloc(handle_size(i))) == 0)
+	    app_error("mm_halloc failed in eval_mm_handles");
+	p = mm_pin(h[i]);
+	if (!IS_ALIGNED(p))
+	    app_error("mm_pin returned an unaligned payload");
+	memset(p, i, handle_size(i));
+	mm_unpin(h[i]);
+	/* blocks from mm_malloc never move, so compaction must go around them */
+	if (i % 4 == 0 && i < n / 2) {
+	    if ((plain[i] = mm_malloc(handle_size(i))) == NULL)
+		app_error("mm_malloc failed in eval_mm_handles");
+	    memset(plain[i], ~i, handle_size(i));
+	}
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+	for (i = pass; i < n; i += 2) {
+	    mm_hfree(h[i]);
+	    h[i] = 0;
+	}
+	for (i = 0; i < n; i += 8)
+	    if (h[i] != 0)
+		pinned[i] = mm_pin(h[i]);
+
+	compacted += mm_compact();
+
+	for (i = 0; i < n; i++) {
+	    if (h[i] != 0) {
+		p = mm_pin(h[i]);
+		if (pinned[i] != NULL && p != pinned[i])
+		    app_error("mm_compact moved a pinned block");
+		check_bytes(p, i, handle_size(i),
+			    "mm_compact did not preserve a handle block");
+		mm_unpin(h[i]);
+		if (pinned[i] != NULL)
+		    mm_unpin(h[i]);
+		pinned[i] = NULL;
+	    }
+	    if (plain[i] != NULL)
+		check_bytes(plain[i], ~i, handle_size(i),
+			    "mm_compact overwrote an mm_malloc block");
+	}
+
+	/* fill the holes again, so the next pass compacts new blocks too */
+	for (i = pass; i < n; i += 2) {
+	    if ((h[i] = mm_halloc(handle_size(i))) == 0)
+		app_error("mm_halloc failed in eval_mm_handles");
+	    memset(mm_pin(h[i]), i, handle_size(i));
+	    mm_unpin(h[i]);
+	}
+    }
+
+    for (i = 0; i < n; i++) {
+	mm_hfree(h[i]);
+	if (plain[i] != NULL)
+	    mm_free(plain[i]);
+    }
+    printf("Handle check passed: %d handles, %lu bytes compacted\n",
+	   n, (unsigned long)compacted);
+    free(h);
+    free(pinned);
+    free(plain);
+}
+
+/*
+ * eval_mm_regions - Allocate n blocks from one region, some of them more
+ *     than a chunk holds, check that none overlap, and reset it; three
+ *     times over, before destroying it. A request too big to round up
+ *     must fail.
+ */
+static void eval_mm_regions(int n)
+{
+    static const size_t sizes[] = {0, 8, 24, 100, 1000, 3000, 20000, 200000};
+    char **blocks = calloc(n, sizeof(char *));
+    mm_region_t *region;
+    int i, round;
+
+    if (blocks == NULL)
+	unix_error("calloc failed in eval_mm_regions");
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_regions");
+    if ((region = mm_region_create()) == NULL)
+	app_error("mm_region_create failed in eval_mm_regions");
+
+    for (round = 0; round < 3; round++) {
+	for (i = 0; i < n; i++) {
+	    size_t size = sizes[(i + round) % 8];
+
+	    if ((blocks[i] = mm_region_alloc(region, size)) == NULL)
+		app_error("mm_region_alloc failed in eval_mm_regions");
+	    if (!IS_ALIGNED(blocks[i]))
+		app_error("mm_region_alloc returned an unaligned block");
+	    memset(blocks[i], i, size);
+	}
+	/* a block that overlapped a later one was overwritten by it */
+	for (i = 0; i < n; i++)
+	    check_bytes(blocks[i], i, sizes[(i + round) % 8],
+			"mm_region_alloc blocks overlap");
+	mm_region_reset(region);
+    }
+    if (mm_region_alloc(region, (size_t)-8) != NULL)
+	app_error("mm_region_alloc took a request that does not fit");
+    mm_region_destroy(region);
+
+    /* the heap must still work after the chunks went back */
+    for (i = 0; i < n; i++)
+	if ((blocks[i] = mm_malloc(sizes[i % 8])) == NULL)
+	    app_error("mm_malloc failed after mm_region_destroy");
+    for (i = 0; i < n; i++)
+	mm_free(blocks[i]);
+    printf("Region check passed: %d blocks, 3 rounds\n", n);
+    free(blocks);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -847,6 +1463,23 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    trace->blocks[trace->ops[i].index] = p;
 	    break;
 
+        case CALLOC: /* calloc */
+	    if ((p = calloc(1, trace->ops[i].size)) == NULL) {
+		malloc_error(tracenum, i, "libc calloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
+        case MEMALIGN: /* posix_memalign */
+	    if (posix_memalign((void **)&p, trace->ops[i].align, 
+			       trace->ops[i].size) != 0) {
+		malloc_error(tracenum, i, "libc posix_memalign failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[trace->ops[i].index];
@@ -891,6 +1524,22 @@ static void eval_libc_speed(void *ptr)
 	    trace->blocks[index] = p;
 	    break;
 
+        case CALLOC: /* calloc */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    if ((p = calloc(1, size)) == NULL)
+		unix_error("calloc failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
+        case MEMALIGN: /* posix_memalign */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    if (posix_memalign((void **)&p, trace->ops[i].align, size) != 0)
+		unix_error("posix_memalign failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
@@ -999,18 +1648,68 @@ void malloc_error(int tracenum, int opnum, char *msg)
     printf("ERROR [trace %d, line %d]: %s\n", tracenum, LINENUM(opnum), msg);
 }
 
+/*
+ * printcounters - Print the mm_stats counters of each valid trace, and
+ *     with -V the mallocs and frees of each size class in use too
+ */
+static void printcounters(int n, stats_t *stats)
+{
+    int i, c;
+    unsigned long mallocs, frees;
+    mm_stats_t *m;
+
+    printf("%5s%9s%9s%9s%9s%9s%7s%8s%7s%6s%8s%8s%7s%8s\n", "trace", 
+	   "mallocs", "frees", "cached", "probed", "visited", "merges", 
+	   "merged", "splits", "sbrks", "sbrkKB", "inplace", "copies", 
+	   "peakKB");
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	m = &stats[i].counters;
+	for (mallocs = frees = 0, c = 0; c < MM_SIZE_CLASSES; c++) {
+	    mallocs += m->mallocs[c];
+	    frees += m->frees[c];
+	}
+	printf("%2d%12lu%9lu%9lu%9lu%9lu%7lu%8lu%7lu%6lu%8.1f%8lu%7lu%8.1f\n", 
+	       i, mallocs, frees, m->cache_mallocs, m->bins_probed, 
+	       m->nodes_visited, m->merges, m->blocks_merged, m->splits, 
+	       m->sbrks, m->sbrk_bytes / 1024.0, m->realloc_in_place, 
+	       m->realloc_copies, m->peak_live_bytes / 1024.0);
+    }
+    if (verbose < 2)
+	return;
+
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	printf("trace %d mallocs/frees by size class:", i);
+	for (c = 0; c < MM_SIZE_CLASSES; c++)
+	    if (stats[i].counters.mallocs[c] || stats[i].counters.frees[c])
+		printf(" 2^%d:%lu/%lu", c, stats[i].counters.mallocs[c], 
+		       stats[i].counters.frees[c]);
+	printf("\n");
+    }
+}
+
 /* 
  * usage - Explain the command line arguments
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>] [-P <n>] [-B <n>] [-N <n>] [-M <n>]\n"
+	    "               [-H <n>] [-R <n>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-B <n>     Only time small malloc/free pairs in 1, 2, 4, ... <n> threads.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H <n>     Only check <n> handle blocks through mm_compact.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-M <n>     Make mem_map fail once <n> bytes are mapped.\n");
+    fprintf(stderr, "\t-N <n>     Only time <n> same-sized nodes at a time, singly and batched.\n");
+    fprintf(stderr, "\t-P <n>     Also replay each trace in <n> threads at once.\n");
+    fprintf(stderr, "\t-R <n>     Only check <n> blocks from a region, reset three times.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
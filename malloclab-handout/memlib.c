@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE     /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,6 +11,7 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
@@ -18,20 +20,53 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER; /* guards mem_brk */
+
+/* a region handed out by mem_map */
+typedef struct mapping {
+    char *start;
+    size_t len;
+    struct mapping *next;
+} mapping_t;
+
+static mapping_t *mem_maps;  /* live mappings, newest first */
+static size_t mem_map_bytes; /* their total length */
+static size_t mem_map_limit = (size_t)-1; /* mem_map fails past this total */
+static size_t mem_peak;      /* largest heap plus mapped size since the last reset */
+static char *mem_clean_brk;  /* the modeled VM holds only zeros from here up */
+#ifdef MM_PRELOAD
+static char *mem_commit_brk; /* the reserved heap is readable and writable up to here */
+#endif
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
+#ifdef MM_PRELOAD
+    /* 
+     * as the process malloc there is no calloc to call; reserve the
+     * address space and let mem_sbrk commit pages as the heap grows
+     */
+    mem_start_brk = mmap(NULL, MAX_HEAP, PROT_NONE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
+	exit(1);
+    }
+    mem_commit_brk = mem_start_brk;
+#else
     /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+    if ((mem_start_brk = (char *)calloc(1, MAX_HEAP)) == NULL) {
 	fprintf(stderr, "mem_init_vm: malloc error\n");
 	exit(1);
     }
+#endif
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_clean_brk = mem_start_brk;
+    mem_peak = 0;
 }
 
 /* 
@@ -39,35 +74,236 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
+    mem_reset_brk();
     free(mem_start_brk);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and drop every mapping left over from mem_map
  */
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+    while (mem_maps != NULL) {
+	mapping_t *m = mem_maps;
+	
+	mem_maps = m->next;
+	munmap(m->start, m->len);
+	free(m);
+    }
+    mem_map_bytes = 0;
+    mem_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap instead, as long as it does not
+ *    go below its first byte. Like fresh pages from the OS, the new area
+ *    always reads as zeros. Safe to call from several threads at once.
  */
 void *mem_sbrk(int incr) 
 {
-    char *old_brk = mem_brk;
+    char *old_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    pthread_mutex_lock(&mem_lock);
+    old_brk = mem_brk;
+    if ( (incr < 0 && (mem_brk - mem_start_brk) < -(long)incr) || 
+	 (incr > 0 && (mem_brk + incr) > mem_max_addr)) {
+	pthread_mutex_unlock(&mem_lock);
 	errno = ENOMEM;
-	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+	fprintf(stderr, "ERROR: mem_sbrk failed. %s...\n",
+		incr < 0 ? "Shrunk below the heap start" : "Ran out of memory");
 	return (void *)-1;
     }
+#ifdef MM_PRELOAD
+    if (incr > 0 && mem_brk + incr > mem_commit_brk) {
+	size_t page = mem_pagesize();
+	char *commit = (char *)(((unsigned long)(mem_brk + incr) + page - 1) & ~(page - 1));
+
+	if (mprotect(mem_commit_brk, commit - mem_commit_brk, PROT_READ | PROT_WRITE) != 0) {
+	    pthread_mutex_unlock(&mem_lock);
+	    errno = ENOMEM;
+	    return (void *)-1;
+	}
+	mem_commit_brk = commit;
+    }
+    if (incr < 0) {
+	/* hand the whole pages above the new brk back; they read as zeros again */
+	size_t page = mem_pagesize();
+	char *keep = (char *)(((unsigned long)(mem_brk + incr) + page - 1) & ~(page - 1));
+
+	if (keep < mem_brk && madvise(keep, mem_brk - keep, MADV_DONTNEED) == 0 &&
+	    mem_clean_brk > keep)
+	    mem_clean_brk = keep;
+    }
+#endif
+    if (incr > 0 && mem_brk < mem_clean_brk)
+	memset(mem_brk, 0, (mem_brk + incr < mem_clean_brk ? mem_brk + incr : mem_clean_brk) - mem_brk);
     mem_brk += incr;
+    if (mem_brk > mem_clean_brk)
+	mem_clean_brk = mem_brk;
+    if (mem_brk - mem_start_brk + mem_map_bytes > mem_peak)
+	mem_peak = mem_brk - mem_start_brk + mem_map_bytes;
+    pthread_mutex_unlock(&mem_lock);
     return (void *)old_brk;
 }
 
+/*
+ * mem_map - map len bytes (rounded up to whole pages) of fresh memory
+ *    outside the heap, like an anonymous mmap. Returns (void *)-1 on
+ *    failure. Safe to call from several threads at once.
+ */
+void *mem_map(size_t len)
+{
+    size_t page = mem_pagesize();
+#ifndef MM_PRELOAD
+    mapping_t *m = (mapping_t *)malloc(sizeof(mapping_t));
+#endif
+    char *start;
+
+    len = (len + page - 1) & ~(page - 1);
+    pthread_mutex_lock(&mem_lock);
+    if (len > mem_map_limit - mem_map_bytes) {
+	pthread_mutex_unlock(&mem_lock);
+#ifndef MM_PRELOAD
+	free(m);
+#endif
+	errno = ENOMEM;
+	return (void *)-1;
+    }
+    pthread_mutex_unlock(&mem_lock);
+    start = mmap(NULL, len, PROT_READ | PROT_WRITE, 
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MM_PRELOAD
+    /* malloc is mm_malloc here, so only the total of the mappings is kept */
+    if (start == MAP_FAILED) {
+	errno = ENOMEM;
+	return (void *)-1;
+    }
+    pthread_mutex_lock(&mem_lock);
+#else
+    if (m == NULL || start == MAP_FAILED) {
+	if (start != MAP_FAILED)
+	    munmap(start, len);
+	free(m);
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    m->start = start;
+    m->len = len;
+
+    pthread_mutex_lock(&mem_lock);
+    m->next = mem_maps;
+    mem_maps = m;
+#endif
+    mem_map_bytes += len;
+    if (mem_brk - mem_start_brk + mem_map_bytes > mem_peak)
+	mem_peak = mem_brk - mem_start_brk + mem_map_bytes;
+    pthread_mutex_unlock(&mem_lock);
+    return (void *)start;
+}
+
+/*
+ * mem_set_map_limit - make mem_map fail once the live mappings would
+ *    total more than bytes, to test how the allocator copes
+ */
+void mem_set_map_limit(size_t bytes)
+{
+    pthread_mutex_lock(&mem_lock);
+    mem_map_limit = bytes;
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/*
+ * mem_unmap - give back a region that mem_map returned; len must be
+ *    what it was mapped with
+ */
+void mem_unmap(void *start, size_t len)
+{
+#ifdef MM_PRELOAD
+    len = (len + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    pthread_mutex_lock(&mem_lock);
+    mem_map_bytes -= len;
+    pthread_mutex_unlock(&mem_lock);
+    munmap(start, len);
+#else
+    mapping_t **p;
+
+    pthread_mutex_lock(&mem_lock);
+    for (p = &mem_maps; *p != NULL; p = &(*p)->next) {
+	if ((*p)->start == (char *)start) {
+	    mapping_t *m = *p;
+	    
+	    *p = m->next;
+	    mem_map_bytes -= m->len;
+	    pthread_mutex_unlock(&mem_lock);
+	    munmap(m->start, m->len);
+	    free(m);
+	    return;
+	}
+    }
+    pthread_mutex_unlock(&mem_lock);
+    fprintf(stderr, "ERROR: mem_unmap of %p (%lu bytes), which is not mapped\n",
+	    start, (unsigned long)len);
+#endif
+}
+
+/*
+ * mem_remap - resize a region that mem_map returned from old_len bytes to
+ *    new_len (rounded up to whole pages), moving its pages elsewhere if it
+ *    cannot grow where it is, like mremap. The contents are kept, without
+ *    a copy. Returns the region's address, or (void *)-1 on failure, in
+ *    which case the old region is untouched.
+ */
+void *mem_remap(void *start, size_t old_len, size_t new_len)
+{
+    size_t page = mem_pagesize();
+    char *moved;
+#ifndef MM_PRELOAD
+    mapping_t *m;
+#endif
+
+    old_len = (old_len + page - 1) & ~(page - 1);
+    new_len = (new_len + page - 1) & ~(page - 1);
+    moved = mremap(start, old_len, new_len, MREMAP_MAYMOVE);
+    if (moved == MAP_FAILED) {
+	errno = ENOMEM;
+	return (void *)-1;
+    }
+
+    pthread_mutex_lock(&mem_lock);
+#ifndef MM_PRELOAD
+    for (m = mem_maps; m != NULL && m->start != (char *)start; m = m->next)
+	;
+    assert(m != NULL);
+    m->start = moved;
+    m->len = new_len;
+#endif
+    mem_map_bytes += new_len - old_len;
+    if (mem_brk - mem_start_brk + mem_map_bytes > mem_peak)
+	mem_peak = mem_brk - mem_start_brk + mem_map_bytes;
+    pthread_mutex_unlock(&mem_lock);
+    return (void *)moved;
+}
+
+/*
+ * mem_in_map - is [lo, hi] inside a single region from mem_map?
+ */
+int mem_in_map(void *lo, void *hi)
+{
+    mapping_t *m;
+    int found = 0;
+
+    pthread_mutex_lock(&mem_lock);
+    for (m = mem_maps; m != NULL && !found; m = m->next)
+	found = (char *)lo >= m->start && (char *)hi < m->start + m->len;
+    pthread_mutex_unlock(&mem_lock);
+    return found;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +328,41 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_mapsize() - returns the bytes currently mapped by mem_map
+ */
+size_t mem_mapsize() 
+{
+    return mem_map_bytes;
+}
+
+/*
+ * mem_peak_footprint() - returns the largest heap plus mapped size in
+ *    bytes since the last mem_reset_brk
+ */
+size_t mem_peak_footprint() 
+{
+    return mem_peak;
+}
+
+/*
+ * mem_fork_lock - hold memlib's lock across a fork, so the child does
+ *    not start with it taken by a thread it does not have
+ */
+void mem_fork_lock(void)
+{
+    pthread_mutex_lock(&mem_lock);
+}
+
+/*
+ * mem_fork_unlock - let go of the lock mem_fork_lock took, in the parent
+ *    or the child
+ */
+void mem_fork_unlock(void)
+{
+    pthread_mutex_unlock(&mem_lock);
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
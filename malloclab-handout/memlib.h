@@ -3,9 +3,18 @@
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void *mem_map(size_t len);
+void mem_unmap(void *start, size_t len);
+void mem_set_map_limit(size_t bytes);
+void mem_fork_lock(void);
+void mem_fork_unlock(void);
+void *mem_remap(void *start, size_t old_len, size_t new_len);
+int mem_in_map(void *lo, void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_mapsize(void);
+size_t mem_peak_footprint(void);
 size_t mem_pagesize(void);
 
@@ -8,11 +8,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+#include <time.h>
+#include <execinfo.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
 
 /*********************************************************
@@ -33,30 +43,356 @@ team_t team = {
 };
 
 
+/*
+ * Coalescing mode, chosen at build time (make MMFLAGS=-DIMMEDIATE_COALESCE=1).
+ *  0: deferred - mm_free only marks a block free, and merge() sweeps the free
+ *     lists once find_free comes up empty.
+ *  1: immediate - free blocks carry a footer and every header a prev-alloc
+ *     bit, so mm_free joins a block with its free neighbors in O(1).
+ */
+#ifndef IMMEDIATE_COALESCE
+#define IMMEDIATE_COALESCE 0
+#endif
+
+/*
+ * Slab runs (make MMFLAGS=-DSLAB=1). Requests of at most SLAB_MAX_SIZE bytes
+ * are served from page-sized runs that each hold objects of one size class
+ * with no per-object header; a byte per heap page says which pages are runs.
+ */
+#ifndef SLAB
+#define SLAB 0
+#endif
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE 64
+#endif
+
+/*
+ * Heap growth policy, chosen at build time (make MMFLAGS=-DGROW_POLICY=1).
+ * A miss extends the free tail block by the shortfall, but never by less
+ * than GROW_MIN bytes, so that runs of small misses do not each pay for an
+ * sbrk and a merge pass.
+ *  0: adaptive - nor by less than the arena's growth step, which doubles
+ *     when a miss comes within GROW_WINDOW requests of the last one and
+ *     halves when it does not. The step stays within GROW_MAX and within
+ *     1/GROW_SHARE of what the arena already holds, so a small heap is
+ *     never grown by much more than it needs.
+ *  1: tight - the shortfall and GROW_MIN only, for the best utilization
+ *     where memory is short.
+ */
+#ifndef GROW_POLICY
+#define GROW_POLICY 0
+#endif
+#ifndef GROW_MIN
+#define GROW_MIN MAP_PAGE_SIZE
+#endif
+#ifndef GROW_MAX
+#define GROW_MAX 0x100000
+#endif
+#ifndef GROW_WINDOW
+#define GROW_WINDOW 32
+#endif
+#ifndef GROW_SHARE
+#define GROW_SHARE 16
+#endif
+
+/*
+ * Heap trimming. Once the free tail block passes TRIM_THRESHOLD bytes more
+ * than the arena's growth step, all but the step is handed back to memlib
+ * (0 turns trimming off). Only
+ * the single arena trims: MULTI_ARENA spans are fenced and interleaved.
+ */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD 0x20000
+#endif
+
+/*
+ * Direct mapping. Requests of MMAP_THRESHOLD bytes or more get pages of
+ * their own from mem_map instead of coming out of the heap, and mm_free
+ * unmaps them straight away (0 turns this off). mm_realloc resizes them
+ * with mem_remap, which moves pages instead of copying bytes.
+ */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD 0x20000
+#endif
+
+/*
+ * Copies that mm_realloc still has to make of STREAM_COPY_MIN bytes or
+ * more use non-temporal stores where the target has SSE2, so that they
+ * do not push everything else out of the cache (0, the default, turns
+ * this off: glibc's memcpy already streams copies bigger than the cache,
+ * and streaming smaller ones only makes them slower). Anything else must
+ * be at least 64, more than the 15 bytes copied to align the target.
+ */
+#ifndef STREAM_COPY_MIN
+#define STREAM_COPY_MIN 0
+#endif
+
+/*
+ * Realloc headroom. Once mm_realloc has grown a block REALLOC_STREAK
+ * times, it gives the block half as much again as was asked for:
+ * it keeps that much of the free space it merged forward, or asks for
+ * that much when the block has to move, so later steps of the growth fit
+ * in place. A block that grows at the top of the heap is not padded,
+ * since sbrk already grows it without a copy. A realloc that leaves more
+ * than that headroom in a block gives the rest back (0 turns the
+ * headroom off).
+ */
+#ifndef REALLOC_STREAK
+#define REALLOC_STREAK 2
+#endif
+
+/*
+ * Compact layout (make MMFLAGS=-DCOMPACT_HEADERS=1). Block headers and
+ * footers shrink to 32 bits and the free-list links become 32-bit offsets
+ * from heap_low, which bring the minimum block down to 16 bytes on 64-bit
+ * hosts. Headers then sit 4 bytes below an 8-byte boundary, so the heap
+ * starts and ends with 4 bytes of padding.
+ */
+#ifndef COMPACT_HEADERS
+#define COMPACT_HEADERS 0
+#endif
+
+/*
+ * Large bin index (make MMFLAGS=-DLARGE_TREE=1). Each large bin is a
+ * red-black tree ordered by (size, address) instead of a list, with the
+ * tree links kept in the free blocks' payloads, so find_free takes the best
+ * fit in O(log n) rather than walking the bin for a first fit.
+ */
+#ifndef LARGE_TREE
+#define LARGE_TREE 0
+#endif
+
+/*
+ * Thread-safe multi-arena mode (make MMFLAGS=-DMULTI_ARENA=1). Threads are
+ * handed out round robin over NARENAS independent arenas, each with its own
+ * free lists and lock, and a block is always freed back to the arena that
+ * owns it. Arenas grow in ARENA_CHUNK aligned spans that end in an allocated
+ * fence word, and a byte per heap page (page_map) names the owning arena.
+ */
+#ifndef MULTI_ARENA
+#define MULTI_ARENA 0
+#endif
+#ifndef NARENAS
+#define NARENAS 8
+#endif
+#ifndef ARENA_CHUNK
+#define ARENA_CHUNK 0x10000
+#endif
+
+/*
+ * Per-thread caches (make MMFLAGS=-DTCACHE=1, normally with MULTI_ARENA).
+ * Each thread keeps a LIFO stack of freed blocks per size class for
+ * payloads of up to TCACHE_MAX_SIZE bytes, so mm_malloc and mm_free on
+ * those sizes touch no shared state. A stack is refilled from the thread's
+ * arena TCACHE_BATCH blocks at a time, and once it holds more than
+ * TCACHE_COUNT, TCACHE_BATCH of them are freed back to their arenas at once.
+ */
+#ifndef TCACHE
+#define TCACHE 0
+#endif
+#ifndef TCACHE_MAX_SIZE
+#define TCACHE_MAX_SIZE 256
+#endif
+#ifndef TCACHE_COUNT
+#define TCACHE_COUNT 16
+#endif
+#ifndef TCACHE_BATCH
+#define TCACHE_BATCH 8
+#endif
+
+/*
+ * Statistics (see mm_stats). Each arena keeps its counters next to its
+ * free lists and bumps them under its own lock, so they cost a few adds
+ * on paths that write there anyway (0 compiles them away).
+ */
+#ifndef STATS
+#define STATS 1
+#endif
+
+/*
+ * Sampling heap profiler (see mm_profile_dump), off unless PROFILE is 1.
+ * Each thread counts down the bytes it allocates, and when the count runs
+ * out the block is sampled: its size, the time and up to PROFILE_DEPTH
+ * return addresses of the caller are kept until it is freed. The gaps are
+ * drawn from an exponential distribution with mean PROFILE_RATE bytes, so
+ * a block of size bytes is sampled with probability 1 - exp(-size/rate)
+ * wherever it falls in the allocation stream.
+ */
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+#ifndef PROFILE_RATE
+#define PROFILE_RATE 0x80000
+#endif
+#ifndef PROFILE_DEPTH
+#define PROFILE_DEPTH 16
+#endif
+
+/*
+ * Free-block map (BLOCK_MAP=1). Once the heap reaches BLOCK_MAP_MIN bytes,
+ * the arena keeps a bitmap outside it with a bit per ALIGNMENT bytes, set
+ * iff a block on the free lists starts there, and a summary bit per word
+ * of that. merge() then sweeps the bitmap in address order and reads only
+ * the headers of free blocks, where walking the lists hops around the
+ * heap and reads the header after every free block to see if it is free
+ * too. The bitmap costs about 1/64 of the heap.
+ */
+#ifndef BLOCK_MAP
+#define BLOCK_MAP 0
+#endif
+#ifndef BLOCK_MAP_MIN
+#define BLOCK_MAP_MIN 0x100000
+#endif
+
+/*
+ * Free-list representation (make MMFLAGS=-DBIN_ARRAYS=1).
+ *  0: each bin is a doubly linked list threaded through its free blocks.
+ *  1: each bin is a pair of arrays, the sizes and heap offsets of its
+ *     free blocks, in a mapping outside the heap. A block keeps its index in
+ *     its first payload word so it can be swap-removed, and find_free
+ *     scans a bin's sizes in order instead of hopping from block to block.
+ */
+#ifndef BIN_ARRAYS
+#define BIN_ARRAYS 0
+#endif
+
+/*
+ * List order (make MMFLAGS=-DADDRESS_ORDER=1).
+ *  0: a freed block goes at the head of its list (LIFO).
+ *  1: each list is kept in address order, so first fit takes the lowest
+ *     block that fits and neighbors tend to be freed next to each other.
+ *     To find where a block goes without walking the whole list, each bin
+ *     records its lowest block in each of ORDER_REGIONS equal regions of
+ *     the heap, with a bitmap of the regions it has blocks in; the walk
+ *     starts from the nearest such block below.
+ */
+#ifndef ADDRESS_ORDER
+#define ADDRESS_ORDER 0
+#endif
+
+/*
+ * Regions (mm_region_create). A region hands out memory from chunks of
+ * REGION_CHUNK bytes taken with mm_malloc, and frees them all at once.
+ */
+#ifndef REGION_CHUNK
+#define REGION_CHUNK 0x1000
+#endif
+
+#if COMPACT_HEADERS && (MULTI_ARENA || LARGE_TREE)
+#error "COMPACT_HEADERS needs the list bins of a single arena"
+#endif
+#if BIN_ARRAYS && (LARGE_TREE || MULTI_ARENA)
+#error "BIN_ARRAYS replaces the list bins of a single arena"
+#endif
+#if ADDRESS_ORDER && BIN_ARRAYS
+#error "ADDRESS_ORDER orders the list bins, which BIN_ARRAYS does away with"
+#endif
+#if BLOCK_MAP && (IMMEDIATE_COALESCE || MULTI_ARENA)
+#error "BLOCK_MAP speeds up the merge sweep of a single arena with deferred coalescing"
+#endif
+#if STREAM_COPY_MIN && STREAM_COPY_MIN < 64
+#error "STREAM_COPY_MIN must be 0 or at least 64, so copy_bytes has bytes to align with"
+#endif
+
+// config.h raises it to 16 for libmm.so, which must align like the C library's malloc
+#ifndef ALIGNMENT
 #define ALIGNMENT 8
+#endif
 
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
 
+/*
+ * Larger requests fail up front, before rounding them up to a block can
+ * wrap: in mm_malloc, mm_calloc, mm_memalign, mm_malloc_batch, mm_realloc,
+ * mm_halloc and (less a chunk header) mm_region_alloc.
+ */
+#define MAX_REQUEST ((size_t) PTRDIFF_MAX)
+
+#if COMPACT_HEADERS
+// bytes of block header (the name predates the compact layout)
+#define SIZE_T_SIZE sizeof(header)
+#else
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
+#endif
+
+// padding below the first block header that puts payloads on ALIGNMENT
+#define HEADER_PAD (ALIGN(SIZE_T_SIZE) - SIZE_T_SIZE)
 
 
 
 
-#define MIN_BLOCK_SIZE (SIZE_T_SIZE * 3)
+#if IMMEDIATE_COALESCE
+// header, both list links and a footer
+#define MIN_BLOCK_SIZE (ALIGN(SIZE_T_SIZE + 2 * sizeof(link_t) + sizeof(header)))
+#else
+#define MIN_BLOCK_SIZE (ALIGN(SIZE_T_SIZE + 2 * sizeof(link_t)))
+#endif
 
 
 #define MIN_APPROX_SIZE (0x100)
+#define LOG2_MIN_APPROX_SIZE 8
 #define SMALL_LIST_SIZE (MIN_APPROX_SIZE / ALIGNMENT)
 #define LARGE_LIST_SIZE 23
 
-// size of the block 
-#define GET_SIZE(block_header) (*block_header & ~0x1)
+// bin a free block of the given size belongs in
+#define SMALL_INDEX(size) ((size) / ALIGNMENT - 1)
+#define LARGE_INDEX(size) large_index(size)
+
+#if ADDRESS_ORDER
+#define ORDER_REGIONS 64
+// smallest region (in bits of heap offset), which doubles as the heap outgrows them
+#define ORDER_MIN_SHIFT 10
+#define REGION_OF(arena, block) ((unsigned long) ((char *) (block) - (char *) heap_low) >> (arena)->region_shift)
+#endif
+
+#if BIN_ARRAYS
+// small bins first, then large ones
+#define NBINS (SMALL_LIST_SIZE + LARGE_LIST_SIZE)
+#define BIN_INDEX(size) ((size) <= MIN_APPROX_SIZE ? SMALL_INDEX(size) : SMALL_LIST_SIZE + LARGE_INDEX(size))
+// slots a bin's arrays start out with, and the bytes each slot takes
+#define BIN_MIN_CAP 8
+#define BIN_SLOT_SIZE (2 * sizeof(unsigned int))
+#endif
+
+// floor(log2(x)) for x > 0
+#define LOG2(x) ((int) (sizeof(unsigned long) * 8 - 1) - __builtin_clzl((unsigned long) (x)))
+
+// granularity of slab_map and page_map
+#define MAP_PAGE_SIZE 4096
+#define PAGE_INDEX(ptr) ((unsigned long) (ptr) / MAP_PAGE_SIZE - (unsigned long) heap_low / MAP_PAGE_SIZE)
+
+#if SLAB
+#define SLAB_RUN_SIZE MAP_PAGE_SIZE
+#define SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+#define SLAB_CLASS(size) ((size) <= ALIGNMENT ? 0 : SMALL_INDEX(ALIGN(size)))
+#define SLAB_MAP_WORDS (SLAB_RUN_SIZE / ALIGNMENT / 32)
+#else
+#define SLAB_CLASSES 0
+#endif
+
+// bytes at the start of the heap used by the list heads, dummy blocks and padding
+#define INIT_OVERHEAD ((SMALL_LIST_SIZE + LARGE_LIST_SIZE + SLAB_CLASSES + 1) * sizeof(header *) + 2 * HEADER_PAD + \
+	(SMALL_LIST_SIZE - SMALL_INDEX(MIN_BLOCK_SIZE) + LARGE_LIST_SIZE) * MIN_BLOCK_SIZE)
+
+// size of the block (the low bits are flags)
+#define FLAGS 0x7
+#define GET_SIZE(block_header) (*block_header & ~FLAGS)
+#define SET_SIZE(block_header, size) (*block_header = (size) | (*block_header & FLAGS))
 
 // block traversal
 #define LOAD(block_header) ((header **)((char *) block_header + SIZE_T_SIZE))
 #define HEADER(load_ptr) ((header *)((char *) load_ptr - SIZE_T_SIZE))
-#define NEXT_FREE(block_header) (*LOAD(block_header))
-#define PREV_FREE(block_header) (*(LOAD(block_header)+1))
+#define LINKS(block_header) ((link_t *) LOAD(block_header))
+#define NEXT_FREE(block_header) FROM_LINK(LINKS(block_header)[0])
+#define PREV_FREE(block_header) FROM_LINK(LINKS(block_header)[1])
+#define SET_NEXT_FREE(block_header, block) (LINKS(block_header)[0] = TO_LINK(block))
+#define SET_PREV_FREE(block_header, block) (LINKS(block_header)[1] = TO_LINK(block))
+
+// a free block's index in its bin's arrays (BIN_ARRAYS), where the links would be
+#define BIN_SLOT(block_header) (*(unsigned int *) LOAD(block_header))
+
+// payload bytes a free block's list (or tree) links may take up
+#define FREE_LINKS_SIZE ((LARGE_TREE ? 4 : 2) * sizeof(link_t))
 
 
 
@@ -70,330 +406,3371 @@ team_t team = {
 #define MARK_ALLOCATED(block_header) (*block_header = *block_header | 0x1)
 #define MARK_FREE(block_header) (*block_header = (*block_header | 0x1) - 1)
 
+/*
+ * an allocated block from mm_halloc, which mm_compact may move. Its
+ * payload starts with the index of its handle, HANDLE_PREFIX bytes that
+ * keep the caller's part aligned.
+ */
+#define HANDLE_BLOCK 0x4
+#define HANDLE_PREFIX ALIGNMENT
+#define HANDLE_OF(block_header) (*(size_t *) LOAD(block_header))
+// entries in the first handle table, which doubles when full
+#define HANDLES_MIN 256
+
+#if MMAP_THRESHOLD
+// memlib keeps the heap in MAX_HEAP reserved bytes, so anything else was mapped
+#define IS_MAPPED(ptr) ((unsigned long) ((char *) (ptr) - (char *) heap_low) >= MAX_HEAP)
+#endif
+
+#if LARGE_TREE
+// tree links of a large free block; dir 0 is the left child, 1 the right
+#define TREE_CHILD(block_header, dir) (*(LOAD(block_header) + (dir)))
+#define TREE_PARENT(block_header) (*(LOAD(block_header) + 2))
+#define TREE_RED(block_header) (*(size_t *) (LOAD(block_header) + 3))
+#define IS_RED(block_header) ((block_header) != NULL && TREE_RED(block_header))
+
+// the root of large bin i lives in its dummy head's next link
+#define LARGE_ROOT(arena, i) NEXT_FREE((arena)->large_free[i])
+
+// large bin i in (size, address) order
+#define LARGE_FIRST(arena, i) tree_after(LARGE_ROOT(arena, i), 0, NULL)
+#define LARGE_NEXT(arena, i, block) tree_next(block)
+#elif BIN_ARRAYS
+#define LARGE_FIRST(arena, i) bin_at(&(arena)->bin[SMALL_LIST_SIZE + (i)], 0)
+#define LARGE_NEXT(arena, i, block) bin_at(&(arena)->bin[SMALL_LIST_SIZE + (i)], BIN_SLOT(block) + 1)
+#else
+#define LARGE_FIRST(arena, i) NEXT_FREE((arena)->large_free[i])
+#define LARGE_NEXT(arena, i, block) NEXT_FREE(block)
+#endif
+
+// the block small bin i hands out next (the last one freed into it), or NULL
+#if BIN_ARRAYS
+#define SMALL_FIRST(arena, i) bin_at(&(arena)->bin[i], (arena)->bin[i].count - 1)
+#else
+#define SMALL_FIRST(arena, i) NEXT_FREE((arena)->small_free[i])
+#endif
 
+#if IMMEDIATE_COALESCE
+// flag: the block just below this one is allocated
+#define PREV_ALLOC 0x2
+#define IS_PREV_ALLOCATED(block_header) (*block_header & PREV_ALLOC)
 
+// boundary tag in the last word of a free block, and the one just below a block
+#define FOOTER(block_header) ((header *) NEXT(block_header) - 1)
+#define PREV_FOOTER(block_header) ((header *) (block_header) - 1)
+#else
+#define PREV_ALLOC 0
+#endif
+
+
+
+#if COMPACT_HEADERS
+typedef unsigned int header;
+
+// a free-list link: the block's offset from heap_low, 0 for none
+typedef unsigned int link_t;
+#define TO_LINK(block) ((block) == NULL ? 0 : (link_t) ((char *) (block) - (char *) heap_low))
+#define FROM_LINK(link) ((link) == 0 ? NULL : (header *) ((char *) heap_low + (link)))
+#else
 typedef size_t header;
 
+typedef header * link_t;
+#define TO_LINK(block) (block)
+#define FROM_LINK(link) (link)
+#endif
+
+#if SLAB
+/*
+ * A slab run sits at the start of a SLAB_RUN_SIZE aligned page that is the
+ * payload of an ordinary allocated block. Its objects follow the run header
+ * back to back, and bit i of map is set while object i is handed out.
+ */
+typedef struct slab_run {
+	struct slab_run * next;     // runs of this class with free objects
+	struct slab_run * prev;
+	unsigned short size;        // object size
+	unsigned short nobjs;       // objects in the run
+	unsigned short nfree;       // objects not handed out
+	unsigned short hint;        // lowest map word that may have a clear bit
+	unsigned int map[SLAB_MAP_WORDS];
+} slab_run;
+
+#define SLAB_RUN_HEADER ALIGN(sizeof(slab_run))
+#define RUN_OF(ptr) ((slab_run *)((unsigned long) (ptr) & ~(unsigned long) (SLAB_RUN_SIZE - 1)))
+#endif
+
+#if BIN_ARRAYS
+/*
+ * A bin's free blocks: block j starts offsets[j] bytes above heap_low
+ * and has sizes[j] bytes, for j below count, and both arrays have room
+ * for cap. The heap is less than MAX_HEAP bytes, so 32 bits hold either.
+ */
+typedef struct bin_array {
+	unsigned int * sizes;
+	unsigned int * offsets;
+	unsigned int count;
+	unsigned int cap;
+} bin_array;
+
+#define BIN_BLOCK(bin, j) ((header *) ((char *) heap_low + (bin)->offsets[j]))
+#endif
+
+#if REALLOC_STREAK
+// slots in an arena's table of blocks mm_realloc grew, picked by address
+#define REALLOC_TRACK 16
+#define TRACK_SLOT(block) ((unsigned int) (((unsigned long) (block) >> 3) * 0x9e3779b1u) >> 28)
+#endif
+
+/*
+ * An arena is a heap of its own: segregated lists, their occupancy bitmaps
+ * and (with SLAB) runs. Without MULTI_ARENA there is just main_arena, laid
+ * out at the bottom of the heap by mm_init.
+ */
+typedef struct arena {
+	header ** small_free;
+	header ** large_free;
+	
+	/*
+	 * occupancy bitmaps: bit i is set iff small_free[i] (resp. large_free[i])
+	 * has at least one free block, so find_free can skip empty bins with a
+	 * count-trailing-zeros instead of walking them.
+	 */
+	unsigned int small_bins;
+	unsigned int large_bins;
+	
+	/*
+	 * the last block in the heap, the one that ends at the brk (in
+	 * MULTI_ARENA mode, the one below the fence of the arena's newest span)
+	 */
+	header * tail;
+	size_t trim_freed;          // bytes freed since trim_heap last merged
+	
+	/* demand seen by the growth policy (see grow_size) */
+	size_t footprint;           // bytes the arena has taken from memlib
+	size_t grow_step;           // least it grows by on a miss
+	unsigned long requests;     // arena_malloc calls so far
+	unsigned long grow_mark;    // requests at the last miss
+	
+	/*
+	 * no block at or above zero_start has ever been handed out, so the
+	 * arena's memory there is zero but for the headers, links and footers
+	 * of the free blocks that start there (see mm_calloc)
+	 */
+	char * zero_start;
+	
+#if REALLOC_STREAK
+	/* blocks mm_realloc grew lately, and how many times */
+	struct {
+		header * block;
+		unsigned int grows;
+	} grown[REALLOC_TRACK];
+#endif
+#if STATS
+	mm_stats_t stats;
+#endif
+#if BLOCK_MAP
+	/*
+	 * bit i of free_map is set iff a block on the free lists starts at
+	 * map_base + i*ALIGNMENT, and bit j of map_summary iff free_map[j] is
+	 * not 0. They share a mapping of their own, made by the first merge
+	 * in a heap of BLOCK_MAP_MIN bytes and remade twice as big when the
+	 * heap outgrows it. map_lost is set if a mapping fails, and merge
+	 * walks the lists from then on.
+	 */
+	unsigned long * free_map;
+	unsigned long * map_summary;
+	size_t free_map_words;
+	char * map_base;
+	int map_lost;
+#endif
+#if ADDRESS_ORDER
+	/*
+	 * bit r of region_bins[i] is set iff list bin i (small bins first,
+	 * then large ones) has a block in region r, the blocks whose heap
+	 * offsets agree above the low region_shift bits, and
+	 * region_first[i][r] is the lowest of those
+	 */
+	unsigned long long region_bins[SMALL_LIST_SIZE + LARGE_LIST_SIZE];
+	header * region_first[SMALL_LIST_SIZE + LARGE_LIST_SIZE][ORDER_REGIONS];
+	int region_shift;
+#endif
+#if BIN_ARRAYS
+	/*
+	 * the bins, whose arrays are carved from the mapping at bin_pool in
+	 * the order they grow. When that is used up every bin is copied to
+	 * a mapping twice as big as they need, dropping the space old
+	 * copies of their arrays took.
+	 */
+	bin_array bin[NBINS];
+	char * bin_pool;
+	size_t bin_pool_len;
+	size_t bin_pool_used;
+#endif
+#if SLAB
+	/* per size class, the runs that still have free objects */
+	slab_run ** slab_runs;
+#endif
+#if MULTI_ARENA
+	pthread_mutex_t lock;
+	int index;                  // arenas[index] == this arena
+#endif
+} arena_t;
+
+// the first block past an arena's list heads (the dummy head blocks come first)
+#define FIRST_BLOCK(arena) ((header *) ((char *) ((arena)->large_free + LARGE_LIST_SIZE + SLAB_CLASSES + 1) + HEADER_PAD))
+
+#if MULTI_ARENA
+#define ARENA_HEADER ALIGN(sizeof(arena_t))
+// page_map bits: the owning arena's index + 1, and whether the page is a slab run
+#define PAGE_OWNER 0x7f
+#define PAGE_SLAB 0x80
+#define LOCK(arena) pthread_mutex_lock(&(arena)->lock)
+#define UNLOCK(arena) pthread_mutex_unlock(&(arena)->lock)
+#else
+#define LOCK(arena) ((void) (arena))
+#define UNLOCK(arena) ((void) (arena))
+#endif
+
+#if STATS
+#define STAT_ADD(arena, field, n) ((arena)->stats.field += (n))
+#define STAT_LIVE(arena, delta) stat_live(&(arena)->stats, delta)
+#else
+#define STAT_ADD(arena, field, n) ((void) (arena))
+#define STAT_LIVE(arena, delta) ((void) (arena), (void) (delta))
+#endif
+#define STAT(arena, field) STAT_ADD(arena, field, 1)
+// the mm_stats_t size class of a block that can hold usable bytes
+#define STAT_CLASS(usable) ((usable) < 2 ? 0 : LOG2(usable) < MM_SIZE_CLASSES ? LOG2(usable) : MM_SIZE_CLASSES - 1)
+
+#if TCACHE
+#define TCACHE_CLASSES (TCACHE_MAX_SIZE / ALIGNMENT)
+// the class whose blocks can hold size bytes
+#define TCACHE_CLASS(size) ((size) <= ALIGNMENT ? 0 : SMALL_INDEX(ALIGN(size)))
+// the least a block or slab object that was asked for size bytes can hold
+#define SIZED_USABLE(size) (ALIGN((size) + SIZE_T_SIZE) - ALIGN(SIZE_T_SIZE))
+
+/*
+ * A thread's cache, kept in an ordinary block of its arena. head[c] is a
+ * stack of blocks (linked through their first payload word) that can hold
+ * (c+1)*ALIGNMENT bytes each.
+ */
+typedef struct tcache {
+	void * head[TCACHE_CLASSES];
+	unsigned char count[TCACHE_CLASSES];
+	unsigned int epoch;         // mm_epoch when it was made
+#if STATS
+	unsigned long hits, puts;   // not yet added to an arena's stats
+#endif
+} tcache_t;
+#endif
+
 // function defs
 
-void add_to_linked_list(header * node, header * after);
-void add_to_freelist(header * freeblock);
+void add_to_linked_list(arena_t * arena, header * node, header * after);
+void add_to_freelist(arena_t * arena, header * freeblock);
+header * free_block(arena_t * arena, header * block);
+static inline void set_allocated(arena_t * arena, header * block);
 void distribute(header * to_split);
 
 /* Globals */
 
 
 header * heap_low;
-header * heap_high;
 
-header ** small_free;
-header ** large_free;
-int sbrkCount;
+#if MULTI_ARENA
+/*
+ * page_map[i] says which arena owns heap page i (counting MAP_PAGE_SIZE
+ * aligned pages up from the one holding heap_low). It sits in a span of its
+ * own, and a bigger copy is made under heap_lock as the heap outgrows it;
+ * old copies are never reused, so mm_free can read it without a lock.
+ */
+unsigned char * page_map;
+size_t page_map_len;
+
+arena_t * arenas[NARENAS];
+
+/* serializes making arenas and growing them (and page_map) */
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * the arena this thread allocates from. It is only trusted while
+ * thread_epoch matches mm_epoch.
+ */
+static __thread arena_t * thread_arena;
+static __thread unsigned int thread_epoch;
+unsigned int next_arena;
+#else
+arena_t main_arena;
+#endif
+
+/* bumped by every mm_init, so per-thread state from an older heap is dropped */
+unsigned int mm_epoch;
+
+/*
+ * the handle table, mapped from memlib. Entry 0 is never used, so that 0
+ * can stand for no handle.
+ */
+typedef struct handle_entry {
+	header * block;     // the handle's block, or NULL for a free entry
+	size_t pins;        // how many mm_pins are open, or for a free entry the next one
+} handle_entry;
+
+handle_entry * handles;
+size_t handles_len;     // entries mapped
+size_t handles_used;    // entries handed out at some point; the rest are fresh
+size_t handles_free;    // a free entry to reuse first, or 0
+#if MULTI_ARENA
+pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+#define HANDLE_LOCK() pthread_mutex_lock(&handle_lock)
+#define HANDLE_UNLOCK() pthread_mutex_unlock(&handle_lock)
+#else
+#define HANDLE_LOCK() ((void) 0)
+#define HANDLE_UNLOCK() ((void) 0)
+#endif
+
+#if STATS && MMAP_THRESHOLD
+/* counters for mapped blocks, which belong to no arena */
+mm_stats_t map_stats;
+pthread_mutex_t map_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#if TCACHE
+/* this thread's cache, trusted only while thread_tcache_epoch matches mm_epoch */
+static __thread tcache_t * thread_tcache;
+static __thread unsigned int thread_tcache_epoch;
+
+/* flushes a thread's cache when it exits */
+pthread_key_t tcache_key;
+pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+#endif
+
+#if PROFILE
+// slots for allocation sites, live samples and profile_filter counters
+#define PROFILE_SITE_BITS 10
+#define PROFILE_LIVE_BITS 13
+#define PROFILE_FILTER_BITS 12
+#define PROFILE_SITES (1 << PROFILE_SITE_BITS)
+#define PROFILE_LIVE (1 << PROFILE_LIVE_BITS)
+// a hash of ptr into [0, 2^bits)
+#define PROFILE_HASH(ptr, bits) ((unsigned int) (((unsigned long) (ptr) >> 3) * 0x9e3779b1u) >> (32 - (bits)))
+
+/* the samples taken at one call stack; depth is 0 in an unused slot */
+typedef struct profile_site {
+	void * pcs[PROFILE_DEPTH];
+	int depth;
+	unsigned long live_count, live_bytes;   // samples not yet freed
+	unsigned long alloc_count, alloc_bytes; // every sample taken
+	unsigned long freed_count;
+	double lifetime;                        // seconds the freed ones lived
+} profile_site;
+
+/* a sampled block that is still allocated; ptr is NULL in an unused slot */
+typedef struct profile_sample {
+	void * ptr;
+	size_t size;
+	double born;
+	profile_site * site;
+} profile_sample;
+
+/*
+ * Both tables are open-addressed with linear probing and guarded by
+ * profile_lock. profile_filter[i] counts the live samples whose address
+ * hashes to i, so mm_free only takes the lock for a block that may be one.
+ */
+profile_site profile_sites[PROFILE_SITES];
+profile_sample profile_live[PROFILE_LIVE];
+unsigned short profile_filter[1 << PROFILE_FILTER_BITS];
+unsigned long profile_nsites, profile_nlive, profile_dropped;
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * mm_profile_dump prints from a copy of the used sites, which is too big
+ * for the stack; profile_dump_lock lets one dump at a time use it. It is
+ * held across stdio, so it comes before every other lock.
+ */
+static profile_site profile_snapshot[PROFILE_SITES];
+static pthread_mutex_t profile_dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * bytes this thread may allocate before its next sample, and the state of
+ * its random number generator (0 until the first draw seeds it)
+ */
+static __thread long profile_countdown;
+static __thread unsigned long long profile_rng;
+// set while this thread is in the profiler, whose own mallocs go unsampled
+static __thread int profile_busy;
+#endif
+
+#if SLAB && !MULTI_ARENA
+/*
+ * slab_map[i] is nonzero iff heap page i (counting SLAB_RUN_SIZE aligned
+ * pages up from the one holding heap_low) is a slab run. It lives in an ordinary
+ * block and is reallocated as runs are made higher up the heap.
+ */
+unsigned char * slab_map;
+size_t slab_map_len;
+#endif
+
+/*
+ * large_index - index of the power of two class in large_free that holds
+ *  blocks of this size; class i covers [MIN_APPROX_SIZE << i, MIN_APPROX_SIZE << (i+1)).
+ */
+static inline int large_index(size_t size)
+{
+	int i = LOG2(size) - LOG2_MIN_APPROX_SIZE;
+	
+	return i < LARGE_LIST_SIZE ? i : LARGE_LIST_SIZE - 1;
+}
+
+/*
+ * mark_bin - set the occupancy bit of the bin a block of this size goes in
+ */
+static inline void mark_bin(arena_t * arena, size_t size)
+{
+	if(size <= MIN_APPROX_SIZE)
+		arena->small_bins |= 1u << SMALL_INDEX(size);
+	else
+		arena->large_bins |= 1u << LARGE_INDEX(size);
+}
 
 /*
- * the beginning of the region of usable memory (since we use the beginning
- * of the heap for internally used arrays).
+ * unmark_bin - clear the occupancy bit of the bin a block of this size
+ *  goes in, once that bin has run empty
  */
-header * memory_start;
+static inline void unmark_bin(arena_t * arena, size_t size)
+{
+	if(size <= MIN_APPROX_SIZE)
+		arena->small_bins &= ~(1u << SMALL_INDEX(size));
+	else
+		arena->large_bins &= ~(1u << LARGE_INDEX(size));
+}
 
-void add_to_linked_list(header * node, header * after)
+void add_to_linked_list(arena_t * arena, header * node, header * after)
 {
 	header * next = NEXT_FREE(after);
 	
-	PREV_FREE(node) = after;
-	NEXT_FREE(after) = node;
+	SET_PREV_FREE(node, after);
+	SET_NEXT_FREE(after, node);
 	
-	NEXT_FREE(node) = next;
+	SET_NEXT_FREE(node, next);
 	if(next != NULL)
-		PREV_FREE(next) = node;
+		SET_PREV_FREE(next, node);
+	
+	mark_bin(arena, GET_SIZE(node));
 }
 
 
-void remove_from_linked_list(header * node)
+#if ADDRESS_ORDER
+/*
+ * order_bin - the list bin (as region_bins counts them) of a block of
+ *  this size
+ */
+static inline int order_bin(size_t size)
 {
-    header * prevfree = PREV_FREE(node);
-	header * nextfree = NEXT_FREE(node);
-    
-	if(prevfree != NULL)
-		NEXT_FREE(prevfree) = nextfree;
-	if(nextfree != NULL)
-		PREV_FREE(nextfree) = prevfree;
+	return size <= MIN_APPROX_SIZE ? SMALL_INDEX(size) : SMALL_LIST_SIZE + LARGE_INDEX(size);
 }
 
-
-/* 
- * mm_init - initialize the malloc package. set up our segmented free list
- *  headers and create the initial amount of free memory.
+/*
+ * order_coarsen - double the size of the regions, folding each pair of
+ *  them into one
  */
- 
- 
-int mm_init(void)
+static void order_coarsen(arena_t * arena)
 {
-
-	int i;
-    
-    /* starting memory = 1 5 3 6 bytes */
-    sbrkCount = 0x600;
-	heap_low = mem_sbrk(sbrkCount);
-    heap_high = mem_heap_hi();
-    
-	
-	small_free = (header **) heap_low;
-	large_free = small_free + SMALL_LIST_SIZE;
-
-	header * current = (header *) (large_free + LARGE_LIST_SIZE + 1);
-    memory_start = current;
-    
+	int i, r;
 	
-	for(i = 0; i < SMALL_LIST_SIZE; i++)
+	for (i = 0; i < SMALL_LIST_SIZE + LARGE_LIST_SIZE; i++)
 	{
-		if( (i+1) * ALIGNMENT < MIN_BLOCK_SIZE)
-		{
-			small_free[i] = NULL;
-		} else 
-		{
+		unsigned long long bits = arena->region_bins[i];
+		unsigned long long folded = 0;
 		
-			small_free[i] = (header *) current;
-			*current = MIN_BLOCK_SIZE;
-			MARK_ALLOCATED(small_free[i]);
-			
-			PREV_FREE(small_free[i]) = NULL;
-			NEXT_FREE(small_free[i]) = NULL;
-			current = (size_t *) NEXT(small_free[i]);
+		for (r = 0; r < ORDER_REGIONS / 2; r++)
+		{
+			if (bits & 1ull << 2 * r)
+				arena->region_first[i][r] = arena->region_first[i][2 * r];
+			else if (bits & 1ull << (2 * r + 1))
+				arena->region_first[i][r] = arena->region_first[i][2 * r + 1];
+			else
+				continue;
+			folded |= 1ull << r;
 		}
+		arena->region_bins[i] = folded;
 	}
+	arena->region_shift++;
+}
 
-
-	for(i = 0; i < LARGE_LIST_SIZE; i++)
+/*
+ * order_insert - link a free block into list bin i (whose dummy head is
+ *  head) after the last block there with a lower address
+ */
+static void order_insert(arena_t * arena, header * block, int i, header * head)
+{
+	header * after = head;
+	unsigned long long below;
+	unsigned int r;
+	
+	while ((r = REGION_OF(arena, block)) >= ORDER_REGIONS)
+		order_coarsen(arena);
+	
+	// the highest region at or below r with a block lower than this one
+	below = arena->region_bins[i] & ((2ull << r) - 1);
+	if ((below & 1ull << r) && arena->region_first[i][r] > block)
+		below &= ~(1ull << r);
+	if (below != 0)
 	{
-		large_free[i] = (header *) current;
-		*current = MIN_BLOCK_SIZE;
-		MARK_ALLOCATED(large_free[i]);
-		
-		PREV_FREE(large_free[i]) = NULL;
-		NEXT_FREE(large_free[i]) = NULL;
-		current = (header *) NEXT(large_free[i]);
+		after = arena->region_first[i][63 - __builtin_clzll(below)];
+		while (NEXT_FREE(after) != NULL && NEXT_FREE(after) < block)
+			after = NEXT_FREE(after);
 	}
+	add_to_linked_list(arena, block, after);
 	
+	if (!(arena->region_bins[i] & 1ull << r) || arena->region_first[i][r] > block)
+	{
+		arena->region_first[i][r] = block;
+		arena->region_bins[i] |= 1ull << r;
+	}
+}
+
+/*
+ * order_remove - forget a free block that is about to leave its list bin
+ */
+static void order_remove(arena_t * arena, header * block)
+{
+	int i = order_bin(GET_SIZE(block));
+	unsigned int r = REGION_OF(arena, block);
+	header * next;
 	
-	*current = (header) heap_high - (header) current + 1;
+	if (arena->region_first[i][r] != block)
+		return;
+	next = NEXT_FREE(block);
+	if (next != NULL && REGION_OF(arena, next) == r)
+		arena->region_first[i][r] = next;
+	else
+		arena->region_bins[i] &= ~(1ull << r);
+}
+#endif
 
-	add_to_freelist((header *) current);
-    
+#if BIN_ARRAYS
+/*
+ * bin_at - block j of bin, or NULL past its end
+ */
+static inline header * bin_at(bin_array * bin, unsigned int j)
+{
+	return j < bin->count ? BIN_BLOCK(bin, j) : NULL;
+}
 
-	return 0;
+/*
+ * bin_fit - index of the first block in bin with at least size bytes, or
+ *  bin->count if none has. The sizes are compared four at a time, which
+ *  the compiler can do with vector compares.
+ */
+static inline unsigned int bin_fit(bin_array * bin, size_t size)
+{
+	unsigned int * s = bin->sizes;
+	unsigned int n = bin->count;
+	unsigned int j = 0;
+	
+	for (; j + 4 <= n; j += 4)
+		if ((s[j] >= size) | (s[j + 1] >= size) | (s[j + 2] >= size) | (s[j + 3] >= size))
+			break;
+	for (; j < n; j++)
+		if (s[j] >= size)
+			break;
+	return j;
 }
 
+/*
+ * bin_place - give bin arrays for cap slots at the end of the pool, which
+ *  has room for them, copying over the blocks it holds
+ */
+static void bin_place(arena_t * arena, bin_array * bin, unsigned int cap)
+{
+	unsigned int * sizes = (unsigned int *) (arena->bin_pool + arena->bin_pool_used);
+	unsigned int * offsets = sizes + cap;
+	
+	memcpy(sizes, bin->sizes, bin->count * sizeof(unsigned int));
+	memcpy(offsets, bin->offsets, bin->count * sizeof(unsigned int));
+	bin->sizes = sizes;
+	bin->offsets = offsets;
+	bin->cap = cap;
+	arena->bin_pool_used += cap * BIN_SLOT_SIZE;
+}
 
-void add_to_freelist(header * free_block)
+/*
+ * bin_grow - double the room in bin, or return -1 if memory runs out
+ */
+static int bin_grow(arena_t * arena, bin_array * bin)
 {
+	unsigned int cap = bin->cap ? bin->cap * 2 : BIN_MIN_CAP;
+	char * old = arena->bin_pool;
+	size_t old_len = arena->bin_pool_len;
+	size_t need = cap * BIN_SLOT_SIZE;
+	size_t len = old_len ? old_len : mem_pagesize();
 	int i;
-	size_t size = (size_t) GET_SIZE(free_block);
-
-
-  
-	if(size <= MIN_APPROX_SIZE)
+	
+	if (arena->bin_pool_used + need <= old_len)
 	{
-		i = size / ALIGNMENT - 1;
-		add_to_linked_list(free_block, small_free[i]);
-	} 
-    
-   
-    else 
+		bin_place(arena, bin, cap);
+		return 0;
+	}
+	
+	// repack every bin into a new pool
+	for (i = 0; i < NBINS; i++)
+		if (&arena->bin[i] != bin)
+			need += arena->bin[i].cap * BIN_SLOT_SIZE;
+	while (len < 2 * need)
+		len *= 2;
+	if ((arena->bin_pool = mem_map(len)) == (void *) -1)
 	{
-		for(i = 0; i < LARGE_LIST_SIZE; i ++)
-		{
-			if( (unsigned long) MIN_APPROX_SIZE << (i + 1) > size )
-			{
-				add_to_linked_list(free_block, large_free[i]);
-				return;
-			}
-		}
-
+		arena->bin_pool = old;
+		return -1;
 	}
+	arena->bin_pool_len = len;
+	arena->bin_pool_used = 0;
+	for (i = 0; i < NBINS; i++)
+		if (&arena->bin[i] == bin)
+			bin_place(arena, bin, cap);
+		else if (arena->bin[i].cap != 0)
+			bin_place(arena, &arena->bin[i], arena->bin[i].cap);
+	if (old != NULL)
+		mem_unmap(old, old_len);
+	return 0;
 }
 
-
-void * allocate(header * block, size_t size)
+/*
+ * bin_push - add a free block to the end of its bin, or return -1 if there
+ *  is no memory to grow the bin into. A free block needs a slot for
+ *  bin_remove to find, so the block is then marked allocated and leaked.
+ */
+static int bin_push(arena_t * arena, header * block)
 {
-
-    remove_from_linked_list(block);
-	size_t split_size = (size_t)*block - size;
-    
-    if(split_size >= MIN_BLOCK_SIZE)
-    {
-
-		
-        *block = size;
-		header * split = NEXT(block);
-		*split = split_size;
-        
-      
-        MARK_FREE(split);
-        add_to_freelist(split);
-    } else 
+	size_t size = GET_SIZE(block);
+	bin_array * bin = &arena->bin[BIN_INDEX(size)];
+	
+	if (bin->count == bin->cap && bin_grow(arena, bin) < 0)
 	{
-
-		remove_from_linked_list(block);
+		set_allocated(arena, block);
+		return -1;
 	}
-	
-    MARK_ALLOCATED(block);
-   
-    return (void *) LOAD(block);
+	bin->sizes[bin->count] = size;
+	bin->offsets[bin->count] = (char *) block - (char *) heap_low;
+	BIN_SLOT(block) = bin->count++;
+	mark_bin(arena, size);
+	return 0;
 }
 
-header * find_free(size_t size)
+/*
+ * bin_remove - take a free block out of its bin, moving the bin's last
+ *  block into its slot
+ */
+static void bin_remove(arena_t * arena, header * block)
 {
-
-    int i;
-    
-
-    if (size <= MIN_APPROX_SIZE)
+	size_t size = GET_SIZE(block);
+	bin_array * bin = &arena->bin[BIN_INDEX(size)];
+	unsigned int j = BIN_SLOT(block);
+	
+	assert(j < bin->count && BIN_BLOCK(bin, j) == block);
+	if (j != --bin->count)
 	{
-        for (i = size/ALIGNMENT-1; 
-			 i < SMALL_LIST_SIZE && NEXT_FREE(small_free[i]) == NULL;
-			 i++){}
-        
-        if (i < SMALL_LIST_SIZE) 
+		bin->sizes[j] = bin->sizes[bin->count];
+		bin->offsets[j] = bin->offsets[bin->count];
+		BIN_SLOT(BIN_BLOCK(bin, j)) = j;
+	}
+	if (bin->count == 0)
+		unmark_bin(arena, size);
+}
+#endif
+
+void remove_from_linked_list(arena_t * arena, header * node)
+{
+    header * prevfree = PREV_FREE(node);
+	header * nextfree = NEXT_FREE(node);
+    
+	if(prevfree != NULL)
+		SET_NEXT_FREE(prevfree, nextfree);
+	if(nextfree != NULL)
+		SET_PREV_FREE(nextfree, prevfree);
+	
+	// the dummy heads are the only allocated blocks on a free list
+	if(nextfree == NULL && prevfree != NULL && IS_ALLOCATED(prevfree))
+		unmark_bin(arena, GET_SIZE(node));
+}
+
+#if LARGE_TREE
+/*
+ * tree_rotate - rotate the subtree at x so that x moves down to the dir side
+ *  and its child on the other side takes its place
+ */
+static void tree_rotate(header ** root, header * x, int dir)
+{
+	header * y = TREE_CHILD(x, !dir);
+	header * parent = TREE_PARENT(x);
+	
+	TREE_CHILD(x, !dir) = TREE_CHILD(y, dir);
+	if(TREE_CHILD(y, dir) != NULL)
+		TREE_PARENT(TREE_CHILD(y, dir)) = x;
+	
+	TREE_PARENT(y) = parent;
+	if(parent == NULL)
+		*root = y;
+	else
+		TREE_CHILD(parent, TREE_CHILD(parent, 1) == x) = y;
+	
+	TREE_CHILD(y, dir) = x;
+	TREE_PARENT(x) = y;
+}
+
+/*
+ * tree_insert - add a free block to the tree at root and rebalance
+ */
+static void tree_insert(header ** root, header * node)
+{
+	header * parent = NULL;
+	header * current = *root;
+	int dir = 0;
+	
+	while(current != NULL)
+	{
+		parent = current;
+		dir = GET_SIZE(current) < GET_SIZE(node) || (GET_SIZE(current) == GET_SIZE(node) && current < node);
+		current = TREE_CHILD(current, dir);
+	}
+	
+	TREE_PARENT(node) = parent;
+	TREE_CHILD(node, 0) = NULL;
+	TREE_CHILD(node, 1) = NULL;
+	TREE_RED(node) = 1;
+	if(parent == NULL)
+		*root = node;
+	else
+		TREE_CHILD(parent, dir) = node;
+	
+	// a red node may not have a red parent
+	while((parent = TREE_PARENT(node)) != NULL && TREE_RED(parent))
+	{
+		header * grand = TREE_PARENT(parent);
+		int side = TREE_CHILD(grand, 1) == parent;
+		header * uncle = TREE_CHILD(grand, !side);
+		
+		if(IS_RED(uncle))
+		{
+			TREE_RED(parent) = 0;
+			TREE_RED(uncle) = 0;
+			TREE_RED(grand) = 1;
+			node = grand;
+		} else
+		{
+			if(node == TREE_CHILD(parent, !side))
+			{
+				tree_rotate(root, parent, side);
+				node = parent;
+				parent = TREE_PARENT(node);
+			}
+			TREE_RED(parent) = 0;
+			TREE_RED(grand) = 1;
+			tree_rotate(root, grand, !side);
+		}
+	}
+	TREE_RED(*root) = 0;
+}
+
+/*
+ * tree_replace - put v where u hangs in the tree (v may be NULL)
+ */
+static void tree_replace(header ** root, header * u, header * v)
+{
+	header * parent = TREE_PARENT(u);
+	
+	if(parent == NULL)
+		*root = v;
+	else
+		TREE_CHILD(parent, TREE_CHILD(parent, 1) == u) = v;
+	if(v != NULL)
+		TREE_PARENT(v) = parent;
+}
+
+/*
+ * tree_remove - take a block out of the tree at root and rebalance
+ */
+static void tree_remove(header ** root, header * node)
+{
+	header * x;              // what ends up where a node was unlinked
+	header * parent;         // and its parent, as x may be NULL
+	int red;
+	
+	if(TREE_CHILD(node, 0) == NULL || TREE_CHILD(node, 1) == NULL)
+	{
+		x = TREE_CHILD(node, TREE_CHILD(node, 0) == NULL);
+		parent = TREE_PARENT(node);
+		red = TREE_RED(node);
+		tree_replace(root, node, x);
+	} else
+	{
+		// unlink the successor instead and move it into node's place
+		header * next = TREE_CHILD(node, 1);
+		
+		while(TREE_CHILD(next, 0) != NULL)
+			next = TREE_CHILD(next, 0);
+		red = TREE_RED(next);
+		x = TREE_CHILD(next, 1);
+		
+		if(TREE_PARENT(next) == node)
+			parent = next;
+		else
+		{
+			parent = TREE_PARENT(next);
+			tree_replace(root, next, x);
+			TREE_CHILD(next, 1) = TREE_CHILD(node, 1);
+			TREE_PARENT(TREE_CHILD(next, 1)) = next;
+		}
+		tree_replace(root, node, next);
+		TREE_CHILD(next, 0) = TREE_CHILD(node, 0);
+		TREE_PARENT(TREE_CHILD(next, 0)) = next;
+		TREE_RED(next) = TREE_RED(node);
+	}
+	if(red)
+		return;
+	
+	// a black node is gone: x carries an extra black until it can be dropped
+	while(x != *root && !IS_RED(x))
+	{
+		int side = TREE_CHILD(parent, 1) == x;
+		header * sibling = TREE_CHILD(parent, !side);
+		
+		if(TREE_RED(sibling))
+		{
+			TREE_RED(sibling) = 0;
+			TREE_RED(parent) = 1;
+			tree_rotate(root, parent, side);
+			sibling = TREE_CHILD(parent, !side);
+		}
+		
+		if(!IS_RED(TREE_CHILD(sibling, 0)) && !IS_RED(TREE_CHILD(sibling, 1)))
+		{
+			TREE_RED(sibling) = 1;
+			x = parent;
+			parent = TREE_PARENT(x);
+		} else
+		{
+			if(!IS_RED(TREE_CHILD(sibling, !side)))
+			{
+				TREE_RED(TREE_CHILD(sibling, side)) = 0;
+				TREE_RED(sibling) = 1;
+				tree_rotate(root, sibling, !side);
+				sibling = TREE_CHILD(parent, !side);
+			}
+			TREE_RED(sibling) = TREE_RED(parent);
+			TREE_RED(parent) = 0;
+			TREE_RED(TREE_CHILD(sibling, !side)) = 0;
+			tree_rotate(root, parent, side);
+			x = *root;
+		}
+	}
+	if(x != NULL)
+		TREE_RED(x) = 0;
+}
+
+/*
+ * tree_fit - the smallest block of at least size bytes in the tree, or NULL
+ */
+static header * tree_fit(header * node, size_t size)
+{
+	header * best = NULL;
+	
+	while(node != NULL)
+	{
+		if(GET_SIZE(node) >= size)
+		{
+			best = node;
+			node = TREE_CHILD(node, 0);
+		} else
+			node = TREE_CHILD(node, 1);
+	}
+	return best;
+}
+
+/*
+ * tree_after - the first block in the tree that comes after (size, block)
+ *  in (size, address) order, or NULL
+ */
+static header * tree_after(header * node, size_t size, header * block)
+{
+	header * best = NULL;
+	
+	while(node != NULL)
+	{
+		if(GET_SIZE(node) > size || (GET_SIZE(node) == size && node > block))
+		{
+			best = node;
+			node = TREE_CHILD(node, 0);
+		} else
+			node = TREE_CHILD(node, 1);
+	}
+	return best;
+}
+
+/*
+ * tree_next - the in-order successor of a block in its tree, or NULL
+ */
+static header * tree_next(header * node)
+{
+	header * parent;
+	
+	if(TREE_CHILD(node, 1) != NULL)
+	{
+		node = TREE_CHILD(node, 1);
+		while(TREE_CHILD(node, 0) != NULL)
+			node = TREE_CHILD(node, 0);
+		return node;
+	}
+	while((parent = TREE_PARENT(node)) != NULL && TREE_CHILD(parent, 1) == node)
+		node = parent;
+	return parent;
+}
+#endif
+
+#if BLOCK_MAP
+#define MAP_BITS (sizeof(unsigned long) * 8)
+// the bit of free_map for a block at ptr
+#define MAP_INDEX(arena, ptr) ((size_t) ((char *) (ptr) - (arena)->map_base) / ALIGNMENT)
+// bytes of a mapping that holds a free_map of words words and its summary
+#define MAP_BYTES(words) (((words) + (words) / MAP_BITS) * sizeof(unsigned long))
+
+/*
+ * map_grow - remake arena's free_map big enough to hold bit index. Its
+ *  length stays a multiple of MAP_BITS words, which the summary covers.
+ */
+static void map_grow(arena_t * arena, size_t index)
+{
+	size_t old = arena->free_map_words;
+	size_t words = old;
+	unsigned long * map;
+	
+	if (words == 0)
+		words = mem_pagesize() / sizeof(unsigned long);
+	while (words * MAP_BITS <= index)
+		words *= 2;
+	
+	// a fresh mapping is zero, so only the old words need copying
+	map = mem_map(MAP_BYTES(words));
+	if (arena->free_map != NULL)
+	{
+		if (map != (void *) -1)
+		{
+			memcpy(map, arena->free_map, old * sizeof(unsigned long));
+			memcpy(map + words, arena->map_summary, old / MAP_BITS * sizeof(unsigned long));
+		}
+		mem_unmap(arena->free_map, MAP_BYTES(old));
+	}
+	if (map == (void *) -1)
+	{
+		arena->free_map = NULL;
+		arena->free_map_words = 0;
+		arena->map_lost = 1;
+		return;
+	}
+	arena->free_map = map;
+	arena->map_summary = map + words;
+	arena->free_map_words = words;
+}
+
+/*
+ * map_set - mark the block that starts at block free in free_map, if
+ *  the arena keeps one
+ */
+static inline void map_set(arena_t * arena, header * block)
+{
+	size_t i = MAP_INDEX(arena, block);
+	size_t w = i / MAP_BITS;
+	
+	if (arena->free_map == NULL)
+		return;
+	if (w >= arena->free_map_words)
+	{
+		map_grow(arena, i);
+		if (arena->map_lost)
+			return;
+	}
+	arena->free_map[w] |= 1UL << (i % MAP_BITS);
+	arena->map_summary[w / MAP_BITS] |= 1UL << (w % MAP_BITS);
+}
+
+/*
+ * map_clear - unmark the block that starts at block in free_map
+ */
+static inline void map_clear(arena_t * arena, header * block)
+{
+	size_t i = MAP_INDEX(arena, block);
+	size_t w = i / MAP_BITS;
+	
+	if (w < arena->free_map_words && 
+		(arena->free_map[w] &= ~(1UL << (i % MAP_BITS))) == 0)
+		arena->map_summary[w / MAP_BITS] &= ~(1UL << (w % MAP_BITS));
+}
+
+/*
+ * map_test - is there a block on the free lists at block?
+ */
+static inline int map_test(arena_t * arena, header * block)
+{
+	size_t i = MAP_INDEX(arena, block);
+	
+	return i / MAP_BITS < arena->free_map_words && 
+		(arena->free_map[i / MAP_BITS] >> (i % MAP_BITS) & 1);
+}
+
+/*
+ * map_next - the first bit set in free_map at or after bit i, or
+ *  (size_t) -1 if there is none. The summary skips empty words.
+ */
+static size_t map_next(arena_t * arena, size_t i)
+{
+	size_t w = i / MAP_BITS;
+	size_t s;
+	unsigned long bits;
+	
+	if (w >= arena->free_map_words)
+		return (size_t) -1;
+	bits = arena->free_map[w] & (~0UL << (i % MAP_BITS));
+	if (bits != 0)
+		return w * MAP_BITS + __builtin_ctzl(bits);
+	
+	if (++w == arena->free_map_words)
+		return (size_t) -1;
+	s = w / MAP_BITS;
+	bits = arena->map_summary[s] & (~0UL << (w % MAP_BITS));
+	while (bits == 0)
+	{
+		if (++s == arena->free_map_words / MAP_BITS)
+			return (size_t) -1;
+		bits = arena->map_summary[s];
+	}
+	w = s * MAP_BITS + __builtin_ctzl(bits);
+	return w * MAP_BITS + __builtin_ctzl(arena->free_map[w]);
+}
+
+/*
+ * map_build - make arena's free_map by walking the heap from its first
+ *  block (a list head) to its tail, or give up on it if that fails
+ */
+static void map_build(arena_t * arena)
+{
+	header * block = (header *) arena->map_base;
+	
+	map_grow(arena, MAP_INDEX(arena, arena->tail));
+	if (arena->map_lost)
+		return;
+	for (;;)
+	{
+		if (GET_SIZE(block) >= MIN_BLOCK_SIZE && IS_ALLOCATED(block) == 0)
+			map_set(arena, block);
+		if (block == arena->tail)
+			break;
+		block = NEXT(block);
+	}
+}
+#endif
+
+/*
+ * remove_from_freelist - take a free block off the list (or, with
+ *  LARGE_TREE, the tree) of the bin it is in
+ */
+static void remove_from_freelist(arena_t * arena, header * block)
+{
+#if BLOCK_MAP
+	map_clear(arena, block);
+#endif
+#if LARGE_TREE
+	size_t size = GET_SIZE(block);
+	
+	if(size > MIN_APPROX_SIZE)
+	{
+		header ** root = &LARGE_ROOT(arena, LARGE_INDEX(size));
+		
+		tree_remove(root, block);
+		if(*root == NULL)
+			unmark_bin(arena, size);
+		return;
+	}
+#endif
+#if BIN_ARRAYS
+	bin_remove(arena, block);
+#else
+#if ADDRESS_ORDER
+	order_remove(arena, block);
+#endif
+	remove_from_linked_list(arena, block);
+#endif
+}
+
+
+/*
+ * arena_layout - put arena's list heads and dummy blocks at the start of
+ *  [start, end) and make the rest of it the arena's first free block.
+ */
+static void arena_layout(arena_t * arena, char * start, char * end)
+{
+	int i;
+	
+	arena->small_bins = 0;
+	arena->large_bins = 0;
+	arena->trim_freed = 0;
+#if ADDRESS_ORDER
+	memset(arena->region_bins, 0, sizeof(arena->region_bins));
+	arena->region_shift = ORDER_MIN_SHIFT;
+#endif
+#if REALLOC_STREAK
+	memset(arena->grown, 0, sizeof(arena->grown));
+#endif
+#if BIN_ARRAYS
+	// as with free_map, memlib has dropped the old pool
+	memset(arena->bin, 0, sizeof(arena->bin));
+	arena->bin_pool = NULL;
+	arena->bin_pool_len = 0;
+	arena->bin_pool_used = 0;
+#endif
+#if BLOCK_MAP
+	// memlib dropped the last heap's mappings, old bitmap and all
+	arena->free_map = NULL;
+	arena->free_map_words = 0;
+	arena->map_lost = 0;
+#endif
+#if STATS
+	memset(&arena->stats, 0, sizeof(arena->stats));
+#endif
+	arena->footprint = end - start;
+	arena->grow_step = GROW_MIN;
+	arena->requests = 0;
+	arena->grow_mark = 0;
+	arena->small_free = (header **) start;
+	arena->large_free = arena->small_free + SMALL_LIST_SIZE;
+
+	header * current = FIRST_BLOCK(arena);
+#if BLOCK_MAP
+	// where map_build starts its walk; every header sits a multiple of ALIGNMENT past it
+	arena->map_base = (char *) current;
+#endif
+    
+#if SLAB
+	arena->slab_runs = (slab_run **) (arena->large_free + LARGE_LIST_SIZE);
+	for(i = 0; i < SLAB_CLASSES; i++)
+		arena->slab_runs[i] = NULL;
+#endif
+    
+	
+	for(i = 0; i < SMALL_LIST_SIZE; i++)
+	{
+		if( (i+1) * ALIGNMENT < MIN_BLOCK_SIZE)
+		{
+			arena->small_free[i] = NULL;
+		} else 
+		{
+		
+			arena->small_free[i] = (header *) current;
+			*current = MIN_BLOCK_SIZE;
+			MARK_ALLOCATED(arena->small_free[i]);
+			
+			SET_PREV_FREE(arena->small_free[i], NULL);
+			SET_NEXT_FREE(arena->small_free[i], NULL);
+			current = (header *) NEXT(arena->small_free[i]);
+		}
+	}
+
+
+	for(i = 0; i < LARGE_LIST_SIZE; i++)
+	{
+		arena->large_free[i] = (header *) current;
+		*current = MIN_BLOCK_SIZE;
+		MARK_ALLOCATED(arena->large_free[i]);
+		
+		SET_PREV_FREE(arena->large_free[i], NULL);
+		SET_NEXT_FREE(arena->large_free[i], NULL);
+		current = (header *) NEXT(arena->large_free[i]);
+	}
+	
+	
+	*current = (end - HEADER_PAD - (char *) current) | PREV_ALLOC;
+	arena->tail = current;
+	arena->zero_start = (char *) current;
+
+	free_block(arena, current);
+}
+
+#if MULTI_ARENA
+/*
+ * span_alloc - sbrk a span of bytes (a multiple of ARENA_CHUNK) that starts
+ *  on an ARENA_CHUNK boundary, and make sure page_map covers it. The caller
+ *  holds heap_lock.
+ */
+static char * span_alloc(size_t bytes)
+{
+	char * brk = (char *) mem_heap_hi() + 1;
+	size_t pad = -(unsigned long) brk & (ARENA_CHUNK - 1);
+	char * span = mem_sbrk(pad + bytes);
+	
+	if(span == (void *) -1)
+		return NULL;
+	span += pad;
+	
+	while(PAGE_INDEX(mem_heap_hi()) >= page_map_len)
+	{
+		size_t len = page_map_len ? page_map_len * 2 : ARENA_CHUNK;
+		unsigned char * map;
+		
+		brk = (char *) mem_heap_hi() + 1;
+		pad = -(unsigned long) brk & (ARENA_CHUNK - 1);
+		if((map = mem_sbrk(pad + len)) == (void *) -1)
+			return NULL;
+		map += pad;
+		memset(map, 0, len);
+		if(page_map != NULL)
+			memcpy(map, page_map, page_map_len);
+		__atomic_store_n(&page_map, map, __ATOMIC_RELEASE);
+		page_map_len = len;
+	}
+	return span;
+}
+
+/*
+ * arena_span - sbrk at least bytes more for arena number index and hand
+ *  them out as one block with a fence above it. If the span ending in tail
+ *  is still at the top of the heap, it grows in place and the block starts
+ *  at its old fence; otherwise a new span is made. The caller holds heap_lock.
+ */
+static header * arena_span(int index, header * tail, size_t bytes)
+{
+	size_t size = (bytes + SIZE_T_SIZE + ARENA_CHUNK - 1) & ~(size_t) (ARENA_CHUNK - 1);
+	int in_place = tail != NULL && (char *) mem_heap_hi() + 1 == (char *) NEXT(tail) + SIZE_T_SIZE;
+	char * span = span_alloc(size);
+	header * block;
+	
+	if(span == NULL)
+		return NULL;
+	memset(page_map + PAGE_INDEX(span), index + 1, size / MAP_PAGE_SIZE);
+	
+	// the fence is an allocated word that no block coalesces with
+	*(header *) (span + size - SIZE_T_SIZE) = SIZE_T_SIZE | 0x1;
+	if(in_place)
+	{
+		block = NEXT(tail);
+		*block = size | (IS_ALLOCATED(tail) ? PREV_ALLOC : 0);
+	} else
+	{
+		block = (header *) span;
+		*block = (size - SIZE_T_SIZE) | PREV_ALLOC;
+	}
+	return block;
+}
+
+/*
+ * arena_new - make arena number index in a span of its own. The caller
+ *  holds heap_lock.
+ */
+static arena_t * arena_new(int index)
+{
+	header * span = arena_span(index, NULL, ARENA_CHUNK - SIZE_T_SIZE);
+	arena_t * arena = (arena_t *) span;
+	char * end;
+	
+	if(span == NULL)
+		return NULL;
+	end = (char *) NEXT(span);
+	
+	pthread_mutex_init(&arena->lock, NULL);
+	arena->index = index;
+	arena_layout(arena, (char *) arena + ARENA_HEADER, end);
+	return arena;
+}
+
+/*
+ * thread_arena_get - the arena the calling thread allocates from, assigning
+ *  it one (round robin) on its first call after mm_init.
+ */
+static arena_t * thread_arena_get(void)
+{
+	if(thread_epoch != mm_epoch)
+	{
+		int index = __sync_fetch_and_add(&next_arena, 1) % NARENAS;
+		
+		pthread_mutex_lock(&heap_lock);
+		if(arenas[index] == NULL)
+			arenas[index] = arena_new(index);
+		pthread_mutex_unlock(&heap_lock);
+		
+		// out of memory for a new arena: share the first one
+		thread_arena = arenas[index] != NULL ? arenas[index] : arenas[0];
+		thread_epoch = mm_epoch;
+	}
+	return thread_arena;
+}
+
+/*
+ * arena_of - the arena that owns the block or slab object at ptr
+ */
+static inline arena_t * arena_of(void * ptr)
+{
+	unsigned char * map = __atomic_load_n(&page_map, __ATOMIC_ACQUIRE);
+	
+	return arenas[(map[PAGE_INDEX(ptr)] & PAGE_OWNER) - 1];
+}
+#else
+#define thread_arena_get() (&main_arena)
+#define arena_of(ptr) (&main_arena)
+#endif
+
+/* 
+ * mm_init - initialize the malloc package. set up our segmented free list
+ *  headers and create the initial amount of free memory.
+ */
+ 
+ 
+int mm_init(void)
+{
+	mm_epoch++;
+#if STATS && MMAP_THRESHOLD
+	memset(&map_stats, 0, sizeof(map_stats));
+#endif
+#if PROFILE
+	pthread_mutex_lock(&profile_lock);
+	memset(profile_sites, 0, sizeof(profile_sites));
+	memset(profile_live, 0, sizeof(profile_live));
+	memset(profile_filter, 0, sizeof(profile_filter));
+	profile_nsites = profile_nlive = profile_dropped = 0;
+	pthread_mutex_unlock(&profile_lock);
+#endif
+	// memlib dropped the old table with the rest of its mappings
+	handles = NULL;
+	handles_len = handles_used = handles_free = 0;
+	
+#if MULTI_ARENA
+	int i;
+	
+	heap_low = mem_heap_lo();
+	page_map = NULL;
+	page_map_len = 0;
+	for(i = 0; i < NARENAS; i++)
+		arenas[i] = NULL;
+	next_arena = 0;
+	
+	// the first thread to allocate gets arena 0, made here
+	if((arenas[0] = arena_new(0)) == NULL)
+		return -1;
+#else
+	arena_t * arena = &main_arena;
+	int sbrkCount;
+    
+    /* 
+     * starting memory = 1 5 3 6 bytes, doubled until the list heads and 
+     * dummy blocks leave room for a first free block (64-bit pointers)
+     */
+    for(sbrkCount = 0x600; sbrkCount < INIT_OVERHEAD + MIN_BLOCK_SIZE; sbrkCount = sbrkCount*2) {}
+	heap_low = mem_sbrk(sbrkCount);
+#if SLAB
+	slab_map = NULL;
+	slab_map_len = 0;
+#endif
+	
+	arena_layout(arena, (char *) heap_low, (char *) mem_heap_hi() + 1);
+#endif
+
+	return 0;
+}
+
+
+void add_to_freelist(arena_t * arena, header * free_block)
+{
+#if BIN_ARRAYS
+	// a block bin_push had to leak is not free for the map either
+	if (bin_push(arena, free_block) < 0)
+		return;
+#endif
+#if BLOCK_MAP
+	map_set(arena, free_block);
+#endif
+#if !BIN_ARRAYS
+	int i;
+	size_t size = (size_t) GET_SIZE(free_block);
+  
+	if(size <= MIN_APPROX_SIZE)
+	{
+		i = SMALL_INDEX(size);
+#if ADDRESS_ORDER
+		order_insert(arena, free_block, i, arena->small_free[i]);
+#else
+		add_to_linked_list(arena, free_block, arena->small_free[i]);
+#endif
+	} 
+    else 
+	{
+		i = LARGE_INDEX(size);
+#if LARGE_TREE
+		tree_insert(&LARGE_ROOT(arena, i), free_block);
+		mark_bin(arena, size);
+#elif ADDRESS_ORDER
+		order_insert(arena, free_block, SMALL_LIST_SIZE + i, arena->large_free[i]);
+#else
+		add_to_linked_list(arena, free_block, arena->large_free[i]);
+#endif
+	}
+#endif
+}
+
+
+/*
+ * set_allocated - mark a block allocated, and with IMMEDIATE_COALESCE let
+ *  the block above it know that its lower neighbor is in use.
+ */
+static inline void set_allocated(arena_t * arena, header * block)
+{
+	MARK_ALLOCATED(block);
+	if((char *) NEXT(block) > arena->zero_start)
+		arena->zero_start = (char *) NEXT(block);
+#if IMMEDIATE_COALESCE
+	if(block != arena->tail)
+		*NEXT(block) |= PREV_ALLOC;
+#endif
+}
+
+/*
+ * scrub - clear what a free block at or above zero_start kept in its
+ *  header, links and footer, as it is about to become the inside of the
+ *  free block below it. The caller has taken it off the free lists.
+ */
+static void scrub(arena_t * arena, header * block)
+{
+	size_t size = GET_SIZE(block);
+	
+	if((char *) block < arena->zero_start)
+		return;
+#if IMMEDIATE_COALESCE
+	*FOOTER(block) = 0;
+#endif
+	memset(block, 0, size < SIZE_T_SIZE + FREE_LINKS_SIZE ? size : SIZE_T_SIZE + FREE_LINKS_SIZE);
+}
+
+/*
+ * free_block - put a block back on the free lists and return the free block
+ *  it ended up in. With IMMEDIATE_COALESCE it is first joined with a free
+ *  block above it (via its header) and below it (via the prev-alloc bit and
+ *  that block's footer), so no two free blocks are ever adjacent.
+ */
+header * free_block(arena_t * arena, header * block)
+{
+#if IMMEDIATE_COALESCE
+	size_t size = GET_SIZE(block);
+	
+	if(block != arena->tail && !IS_ALLOCATED(NEXT(block)))
+	{
+		header * next = NEXT(block);
+		
+		remove_from_freelist(arena, next);
+		size += GET_SIZE(next);
+		scrub(arena, next);
+		if(next == arena->tail)
+			arena->tail = block;
+		STAT(arena, blocks_merged);
+	}
+	
+	if(!IS_PREV_ALLOCATED(block))
+	{
+		header * prev = (header *)((char *) block - GET_SIZE(PREV_FOOTER(block)));
+		
+		remove_from_freelist(arena, prev);
+		size += GET_SIZE(prev);
+		scrub(arena, block);
+		if(block == arena->tail)
+			arena->tail = prev;
+		block = prev;
+		STAT(arena, blocks_merged);
+	}
+	
+	// the block below a free block is always allocated
+	*block = size | PREV_ALLOC;
+	*FOOTER(block) = size;
+	if(block != arena->tail)
+		*NEXT(block) &= ~PREV_ALLOC;
+#else
+	MARK_FREE(block);
+#endif
+	add_to_freelist(arena, block);
+	
+	return block;
+}
+
+/*
+ * split - cut a block down to size bytes and free whatever is left over,
+ *  provided the remainder is big enough to be a block of its own.
+ */
+static void split(arena_t * arena, header * block, size_t size)
+{
+	size_t split_size = GET_SIZE(block) - size;
+	
+	if(split_size >= MIN_BLOCK_SIZE)
+	{
+		SET_SIZE(block, size);
+		header * split = NEXT(block);
+		*split = split_size | PREV_ALLOC;
+		
+		if(block == arena->tail)
+			arena->tail = split;
+		free_block(arena, split);
+		STAT(arena, splits);
+	}
+}
+
+void * allocate(arena_t * arena, header * block, size_t size)
+{
+
+    remove_from_freelist(arena, block);
+	split(arena, block, size);
+	
+    set_allocated(arena, block);
+   
+    return (void *) LOAD(block);
+}
+
+/*
+ * find_free - find a free block of at least size bytes. The occupancy 
+ *  bitmaps take us straight to the first non-empty bin that can hold it.
+ */
+header * find_free(arena_t * arena, size_t size)
+{
+
+    int i;
+    unsigned int bins;
+    
+
+    if (size <= MIN_APPROX_SIZE)
+	{
+		// small bins are exact, so the head of any non-empty bin >= i fits
+        bins = arena->small_bins & (~0u << SMALL_INDEX(size));
+        
+        if (bins != 0) 
+		{
+            STAT(arena, bins_probed);
+            return SMALL_FIRST(arena, __builtin_ctz(bins));
+        }
+
+		i = 0;
+    } else 
+	{
+		i = LARGE_INDEX(size);
+    }
+    
+    // find large free block
+    bins = arena->large_bins & (~0u << i);
+#if LARGE_TREE
+    // best fit: the smallest fit in bin i, or else the smallest block further up
+    if(bins & (1u << i))
+	{
+		header * fit = tree_fit(LARGE_ROOT(arena, i), size);
+		
+		STAT(arena, bins_probed);
+		if(fit != NULL)
+			return fit;
+		bins &= bins - 1;
+	}
+    if(bins != 0)
+	{
+		STAT(arena, bins_probed);
+		return LARGE_FIRST(arena, __builtin_ctz(bins));
+	}
+#elif BIN_ARRAYS
+    // first fit, scanning each bin's sizes rather than its blocks
+    while(bins != 0)
+	{
+		bin_array * bin = &arena->bin[SMALL_LIST_SIZE + __builtin_ctz(bins)];
+		unsigned int j = bin_fit(bin, size);
+		
+		STAT(arena, bins_probed);
+		STAT_ADD(arena, nodes_visited, j < bin->count ? j + 1 : j);
+		if (j < bin->count)
+			return BIN_BLOCK(bin, j);
+		bins &= bins - 1;
+	}
+#else
+    while(bins != 0)
+	{
+		i = __builtin_ctz(bins);
+		STAT(arena, bins_probed);
+		
+        header * current = NEXT_FREE(arena->large_free[i]);
+        while (current != NULL)
+		{
+            STAT(arena, nodes_visited);
+            if (GET_SIZE(current) >= size)
+			{
+                return current;
+            }
+            current = NEXT_FREE(current);
+        }
+		bins &= bins - 1;
+    }
+#endif
+    
+ 
+    return NULL;
+}
+
+#if BLOCK_MAP
+/*
+ * map_merge - merge() by a sweep of free_map in address order. Each free
+ *  block takes in the run of free blocks after it, which the map at its
+ *  end tells apart without reading their headers first.
+ */
+static header * map_merge(arena_t * arena, size_t size)
+{
+	size_t i;
+	
+	STAT(arena, merges);
+	for (i = map_next(arena, 0); i != (size_t) -1; i = map_next(arena, i + 1))
+	{
+		header * current = (header *) (arena->map_base + i * ALIGNMENT);
+		header * next = NEXT(current);
+		
+		if (current == arena->tail || !map_test(arena, next))
+			continue;
+		
+		remove_from_freelist(arena, current);
+		do
+		{
+			remove_from_freelist(arena, next);
+			*current += GET_SIZE(next);
+			scrub(arena, next);
+			if (next == arena->tail)
+				arena->tail = current;
+			STAT(arena, blocks_merged);
+			next = NEXT(current);
+		} while (current != arena->tail && map_test(arena, next));
+		add_to_freelist(arena, current);
+		
+		if (size && !IS_ALLOCATED(current) && *current >= size)
+			return current;
+	}
+	return NULL;
+}
+#endif
+
+#if BIN_ARRAYS
+/*
+ * bin_merge - merge() over the bin arrays, each walked from its end. A
+ *  swap-remove only moves a bin's last block, which has been looked at
+ *  already unless the bin has shrunk below the walk, so no block that is
+ *  still to be looked at gets skipped.
+ */
+static header * bin_merge(arena_t * arena, size_t size)
+{
+	int i;
+	unsigned int j;
+	
+	STAT(arena, merges);
+	for (i = SMALL_INDEX(MIN_BLOCK_SIZE); i < NBINS; i++)
+	{
+		bin_array * bin = &arena->bin[i];
+		
+		for (j = bin->count; j-- > 0; )
+		{
+			header * current;
+			header * next;
+			
+			if (j >= bin->count)
+				continue;
+			current = BIN_BLOCK(bin, j);
+			next = NEXT(current);
+			if (current == arena->tail || GET_SIZE(next) < MIN_BLOCK_SIZE || IS_ALLOCATED(next))
+				continue;
+			
+			// take in the whole run of free blocks after current
+			remove_from_freelist(arena, current);
+			do
+			{
+				remove_from_freelist(arena, next);
+				*current += GET_SIZE(next);
+				scrub(arena, next);
+				if (next == arena->tail)
+					arena->tail = current;
+				STAT(arena, blocks_merged);
+				next = NEXT(current);
+			} while (current != arena->tail && GET_SIZE(next) >= MIN_BLOCK_SIZE && 
+					 IS_ALLOCATED(next) == 0);
+			add_to_freelist(arena, current);
+			
+			if (size && !IS_ALLOCATED(current) && *current >= size)
+				return current;
+		}
+	}
+	return NULL;
+}
+#endif
+
+header * merge(arena_t * arena, size_t size)
+{
+#if BLOCK_MAP
+    if (arena->free_map == NULL && !arena->map_lost && arena->footprint >= BLOCK_MAP_MIN)
+        map_build(arena);
+    if (arena->free_map != NULL)
+        return map_merge(arena, size);
+#endif
+#if BIN_ARRAYS
+    return bin_merge(arena, size);
+#else
+    int i = MIN_BLOCK_SIZE / ALIGNMENT - 1;
+    
+    STAT(arena, merges);
+#if LARGE_TREE
+    for (; i < SMALL_LIST_SIZE; i++)
+#else
+    for (; i < SMALL_LIST_SIZE + LARGE_LIST_SIZE - 1; i++)
+#endif
+	{
+        header * current = NEXT_FREE(arena->small_free[i]);
+        header * next;
+        
+        while (current != NULL)
+		{
+            next = NEXT(current);
+            if (next != NULL && current != arena->tail && 
+				GET_SIZE(next) >= MIN_BLOCK_SIZE && 
+				(long unsigned int) IS_ALLOCATED(next) == 0)
+			{
+                
+                
+                
+                remove_from_freelist(arena, current);                
+                remove_from_freelist(arena, next);
+                
+                *current += GET_SIZE(next);
+                scrub(arena, next);
+                if (next == arena->tail)
+                    arena->tail = current;
+                add_to_freelist(arena, current);
+                STAT(arena, blocks_merged);
+                
+                if (size && *current >= size)
+                    return current;
+#if LARGE_TREE
+                // it went into a tree, where NEXT_FREE is no list link
+                if (GET_SIZE(current) > MIN_APPROX_SIZE)
+                    break;
+#endif
+            } else
+			{
+                current = NEXT_FREE(current);
+            }
+        }
+    }
+
+#if LARGE_TREE
+    // walk each tree from a (size, address) cursor, which reinserting cannot upset
+    for (i = 0; i < LARGE_LIST_SIZE; i++)
+	{
+        header * current = LARGE_FIRST(arena, i);
+        header * next;
+        
+        while (current != NULL)
+		{
+            size_t current_size = GET_SIZE(current);
+            
+            next = NEXT(current);
+            if (current != arena->tail && GET_SIZE(next) >= MIN_BLOCK_SIZE && 
+				IS_ALLOCATED(next) == 0)
+			{
+                remove_from_freelist(arena, current);
+                remove_from_freelist(arena, next);
+                
+                *current += GET_SIZE(next);
+                scrub(arena, next);
+                if (next == arena->tail)
+                    arena->tail = current;
+                add_to_freelist(arena, current);
+                STAT(arena, blocks_merged);
+                
+                if (size && *current >= size)
+                    return current;
+                current = tree_after(LARGE_ROOT(arena, i), current_size, current);
+            } else
+			{
+                current = tree_next(current);
+            }
+        }
+    }
+#endif
+
+	return NULL;
+#endif
+}
+
+
+
+/*
+ * sbrk_block - sbrk exactly bytes more, put them on the free lists and
+ *  return the free block that covers them. If the tail (the wilderness
+ *  block) is free, the new bytes just grow it. In MULTI_ARENA mode the bytes
+ *  come from arena_span instead.
+ */
+static header * sbrk_block(arena_t * arena, size_t bytes)
+{
+	header * tail = arena->tail;
+#if MULTI_ARENA
+	header * block;
+	
+	// mem_sbrk takes an int (and a span also needs room for its padding)
+	if(bytes > INT_MAX - ARENA_CHUNK)
+		return NULL;
+	pthread_mutex_lock(&heap_lock);
+	block = arena_span(arena->index, tail, bytes);
+	pthread_mutex_unlock(&heap_lock);
+    if(block == NULL)
+		return NULL;
+#else
+	char * brk;
+	header * block;
+	
+	// mem_sbrk takes an int
+	if(bytes > INT_MAX)
+		return NULL;
+	brk = mem_sbrk(bytes);
+    if(brk == (void *) -1)
+		return NULL;
+    // the new block takes over the padding at the old end of the heap
+    block = (header *) (brk - HEADER_PAD);
+    *block = bytes | (IS_ALLOCATED(tail) ? PREV_ALLOC : 0);
+#endif
+	// a free tail (the wilderness) just grows over the new bytes
+	if(block == NEXT(tail) && !IS_ALLOCATED(tail))
+	{
+		remove_from_freelist(arena, tail);
+		*tail += GET_SIZE(block);
+		*block = 0;
+#if IMMEDIATE_COALESCE
+		*PREV_FOOTER(block) = 0;
+#endif
+		block = tail;
+	}
+    arena->tail = block;
+    arena->footprint += bytes;
+    STAT(arena, sbrks);
+    STAT_ADD(arena, sbrk_bytes, bytes);
+    block = free_block(arena, block);
+    // with BIN_ARRAYS the block is leaked if its bin could not take it
+    return IS_ALLOCATED(block) ? NULL : block;
+}
+
+/*
+ * grow_size - how far to grow the heap for a miss that is bytes short,
+ *  updating the arena's growth step on the way (see GROW_POLICY)
+ */
+static size_t grow_size(arena_t * arena, size_t bytes)
+{
+#if GROW_POLICY == 0
+	size_t step = arena->grow_step;
+	
+	if(arena->requests - arena->grow_mark < GROW_WINDOW)
+		step *= 2;
+	else
+		step /= 2;
+	if(step > GROW_MAX)
+		step = GROW_MAX;
+	if(step > arena->footprint / GROW_SHARE)
+		step = arena->footprint / GROW_SHARE;
+	if(step < GROW_MIN)
+		step = GROW_MIN;
+	step &= ~(size_t) (ALIGNMENT - 1);
+	arena->grow_step = step;
+	arena->grow_mark = arena->requests;
+	
+	if(bytes < step)
+		bytes = step;
+#endif
+	if(bytes < GROW_MIN)
+		bytes = GROW_MIN;
+	return bytes;
+}
+
+/*
+ * extend_heap - grow the heap so that it ends in a free block of at least
+ *  block_size bytes, and return that block
+ */
+static header * extend_heap(arena_t * arena, size_t block_size)
+{
+    size_t bytes = block_size;
+    
+#if !MULTI_ARENA
+    // the free tail already covers part of it (a new span cannot reuse the old tail)
+    if(!IS_ALLOCATED(arena->tail) && GET_SIZE(arena->tail) < block_size)
+		bytes -= GET_SIZE(arena->tail);
+#endif
+    return sbrk_block(arena, grow_size(arena, bytes));
+}
+
+#if !MULTI_ARENA
+/*
+ * release_tail - shrink the heap down to grow_step bytes past the last
+ *  allocated block, if the tail block is free, and return how many bytes
+ *  went back to memlib
+ */
+static size_t release_tail(arena_t * arena)
+{
+	header * tail = arena->tail;
+	size_t release;
+	
+	if(IS_ALLOCATED(tail) || GET_SIZE(tail) <= arena->grow_step)
+		return 0;
+	
+	release = GET_SIZE(tail) - arena->grow_step;
+	assert(release <= arena->footprint);
+	remove_from_freelist(arena, tail);
+	if(mem_sbrk(-(int) release) != (void *) -1)
+	{
+		SET_SIZE(tail, arena->grow_step);
+		arena->footprint -= release;
+		STAT_ADD(arena, trim_bytes, release);
+	}
+	else
+		release = 0;
+	if(arena->zero_start > (char *) NEXT(tail))
+		arena->zero_start = (char *) NEXT(tail);
+	free_block(arena, tail);
+	return release;
+}
+
+/*
+ * close_hole - free the bytes arena_compact has swept together in front
+ *  of an allocated block it cannot move (or at the top of the heap)
+ */
+static void close_hole(arena_t * arena, header * hole, size_t size)
+{
+	// the block below the hole is allocated, or it would be part of it
+	*hole = size | PREV_ALLOC;
+	free_block(arena, hole);
+}
+
+/*
+ * arena_compact - walk the heap from the bottom, sliding each unpinned
+ *  handle block down over the free space below it, so that the free
+ *  blocks between two blocks that cannot move end up as one. The free
+ *  space left on top of the heap goes back to memlib. Returns the bytes
+ *  that did.
+ */
+static size_t arena_compact(arena_t * arena)
+{
+	header * block = FIRST_BLOCK(arena);
+	header * hole = NULL;
+	size_t hole_size = 0;
+	int last;
+	
+	do
+	{
+		size_t size = GET_SIZE(block);
+		
+		last = block == arena->tail;
+		if(!IS_ALLOCATED(block))
+		{
+			// take it off the lists; it is part of the hole now
+			remove_from_freelist(arena, block);
+			if(hole == NULL)
+				hole = block;
+			else
+				scrub(arena, block);
+			hole_size += size;
+		}
+		else if(hole != NULL && (*block & HANDLE_BLOCK) && handles[HANDLE_OF(block)].pins == 0)
+		{
+			memmove(hole, block, size);
+			*hole |= PREV_ALLOC;
+			handles[HANDLE_OF(hole)].block = hole;
+			hole = (header *) ((char *) hole + size);
+		}
+		else if(hole != NULL)
+		{
+			close_hole(arena, hole, hole_size);
+			hole = NULL;
+			hole_size = 0;
+		}
+		block = (header *) ((char *) block + size);
+	} while(!last);
+	
+	if(hole == NULL)
+		return 0;
+	arena->tail = hole;
+	close_hole(arena, hole, hole_size);
+	return release_tail(arena);
+}
+#endif
+
+/*
+ * trim_heap - after freed bytes went back to the arena, shrink the heap
+ *  down to the arena's grow_step bytes past the last allocated block if
+ *  the free tail block has grown TRIM_THRESHOLD bytes past that
+ */
+static void trim_heap(arena_t * arena, size_t freed)
+{
+#if TRIM_THRESHOLD && !MULTI_ARENA
+	header * tail = arena->tail;
+	
+#if !IMMEDIATE_COALESCE
+	// frees do not coalesce here, so merge once enough has been freed to matter
+	arena->trim_freed += freed;
+	if(!IS_ALLOCATED(tail) && arena->trim_freed >= TRIM_THRESHOLD)
+	{
+		arena->trim_freed = 0;
+		merge(arena, 0);
+		tail = arena->tail;
+	}
+#endif
+	if(!IS_ALLOCATED(tail) && GET_SIZE(tail) >= TRIM_THRESHOLD + arena->grow_step)
+		release_tail(arena);
+#endif
+}
+
+/*
+ * block_malloc - allocate an ordinary block of block_size bytes (header
+ *  included) from the segregated lists, merging or growing the heap on a miss.
+ */
+static void * block_malloc(arena_t * arena, size_t block_size)
+{
+    header * block = find_free(arena, block_size);
+    
+#if !IMMEDIATE_COALESCE
+    if(block == NULL)
+		block = merge(arena, block_size);
+#endif
+    
+    if(block == NULL)
+		block = extend_heap(arena, block_size);
+    if(block == NULL)
+		return NULL;
+    
+	// we are sure block is of sufficient size, so we can allocate
+    return allocate(arena, block, block_size);
+}
+
+/*
+ * aligned_start - the lowest align-byte aligned payload address for a block
+ *  starting at block whose header leaves either no gap or a gap big enough
+ *  to be a free block of its own below it
+ */
+static char * aligned_start(header * block, size_t align)
+{
+	char * payload = (char *) LOAD(block);
+	char * p = (char *)(((unsigned long) payload + align - 1) & ~(unsigned long) (align - 1));
+	
+	while(p != payload && (size_t)(p - (char *) block) - SIZE_T_SIZE < MIN_BLOCK_SIZE)
+		p += align;
+	return p;
+}
+
+/*
+ * aligned_payload - where an aligned block of size bytes would go inside
+ *  free block, or NULL if it does not fit there
+ */
+static char * aligned_payload(header * block, size_t size, size_t align)
+{
+	char * p = aligned_start(block, align);
+	
+	if(p - SIZE_T_SIZE + size > (char *) NEXT(block))
+		return NULL;
+	return p;
+}
+
+/*
+ * block_malloc_aligned - allocate an ordinary block of block_size bytes whose
+ *  payload is align-byte aligned. The slack below the payload goes back on
+ *  the free lists, the slack above it is split off as usual. Any free block
+ *  of block_size + align + MIN_BLOCK_SIZE bytes has room for the payload, so
+ *  when no large block fits as it stands we look for one of those.
+ */
+static void * block_malloc_aligned(arena_t * arena, size_t block_size, size_t align)
+{
+	header * block = NULL;
+	header * rest;
+	char * p = NULL;
+	size_t room = block_size + align + MIN_BLOCK_SIZE;
+	unsigned int bins = arena->large_bins;
+	int i;
+	
+	if(block_size > MIN_APPROX_SIZE)
+		bins &= ~0u << LARGE_INDEX(block_size);
+	
+	// first fit over the large bins, checking where the aligned payload lands
+	while(bins != 0 && p == NULL)
+	{
+		i = __builtin_ctz(bins);
+		for(block = LARGE_FIRST(arena, i); block != NULL; block = LARGE_NEXT(arena, i, block))
+		{
+			if((p = aligned_payload(block, block_size, align)) != NULL)
+				break;
+		}
+		bins &= bins - 1;
+	}
+	
+	if(p == NULL && (block = find_free(arena, room)) != NULL)
+		p = aligned_payload(block, block_size, align);
+#if !IMMEDIATE_COALESCE
+	if(p == NULL && (block = merge(arena, room)) != NULL)
+		p = aligned_payload(block, block_size, align);
+#endif
+	
+	if(p == NULL)
+	{
+#if MULTI_ARENA
+		/*
+		 * the new bytes either follow the tail, when the span grows in
+		 * place, or start a span on an ARENA_CHUNK boundary (as the arena
+		 * itself does); ask for enough for either
+		 */
+		char * next = (char *) NEXT(arena->tail);
+		size_t need = aligned_start((header *) next, align) - next - SIZE_T_SIZE + block_size;
+		size_t fresh = align <= ARENA_CHUNK ?
+			aligned_start((header *) arena, align) - (char *) arena - SIZE_T_SIZE + block_size : room;
+		
+		if(need < fresh)
+			need = fresh;
+#else
+		// sbrk just enough for an aligned payload to fit at the start of the new memory
+		char * brk = (char *) mem_heap_hi() + 1 - HEADER_PAD;
+		size_t need = aligned_start((header *) brk, align) - brk - SIZE_T_SIZE + block_size;
+#endif
+		
+		if((block = sbrk_block(arena, need)) == NULL)
+			return NULL;
+		// the new block stays on the free lists if it cannot hold the payload
+		if((p = aligned_payload(block, block_size, align)) == NULL)
+			return NULL;
+	}
+	
+	remove_from_freelist(arena, block);
+	rest = HEADER(p);
+	if(rest != block)
+	{
+		// give the leading gap back; rest is marked allocated so they do not rejoin
+		*rest = ((char *) NEXT(block) - (char *) rest) | 0x1;
+		SET_SIZE(block, (char *) rest - (char *) block);
+		if(block == arena->tail)
+			arena->tail = rest;
+		free_block(arena, block);
+	}
+	split(arena, rest, block_size);
+	set_allocated(arena, rest);
+	
+	return p;
+}
+
+#if SLAB
+/*
+ * slab_mark - record whether the page holding run is a slab run, growing
+ *  slab_map first if the page lies past its end.
+ */
+static int slab_mark(arena_t * arena, slab_run * run, unsigned char is_run)
+{
+	size_t page = PAGE_INDEX(run);
+	
+#if MULTI_ARENA
+	// page_map already covers every span; heap_lock keeps a copy from losing the bit
+	pthread_mutex_lock(&heap_lock);
+	if(is_run)
+		page_map[page] |= PAGE_SLAB;
+	else
+		page_map[page] &= ~PAGE_SLAB;
+	pthread_mutex_unlock(&heap_lock);
+	return 0;
+#else
+	if(page >= slab_map_len)
+	{
+		size_t len = slab_map_len ? slab_map_len : SLAB_RUN_SIZE / 16;
+		unsigned char * map;
+		
+		while(len <= page)
+			len *= 2;
+		if((map = block_malloc(arena, ALIGN(len + SIZE_T_SIZE))) == NULL)
+			return -1;
+		memset(map, 0, len);
+		if(slab_map != NULL)
+		{
+			memcpy(map, slab_map, slab_map_len);
+			free_block(arena, HEADER(slab_map));
+		}
+		slab_map = map;
+		slab_map_len = len;
+	}
+	slab_map[page] = is_run;
+	return 0;
+#endif
+}
+
+/*
+ * slab_lookup - the run holding ptr, or NULL if ptr is an ordinary block
+ */
+static inline slab_run * slab_lookup(void * ptr)
+{
+	size_t page = PAGE_INDEX(ptr);
+	
+#if MULTI_ARENA
+	if(__atomic_load_n(&page_map, __ATOMIC_ACQUIRE)[page] & PAGE_SLAB)
+#else
+	if(page < slab_map_len && slab_map[page])
+#endif
+		return RUN_OF(ptr);
+	return NULL;
+}
+
+/*
+ * slab_new_run - carve a fresh run for class c out of an aligned block
+ */
+static slab_run * slab_new_run(arena_t * arena, int c)
+{
+	slab_run * run = block_malloc_aligned(arena, ALIGN(SLAB_RUN_SIZE + SIZE_T_SIZE), SLAB_RUN_SIZE);
+	size_t size = (c + 1) * ALIGNMENT;
+	int i, n;
+	
+	if(run == NULL)
+		return NULL;
+	if(slab_mark(arena, run, 1) < 0)
+	{
+		free_block(arena, HEADER(run));
+		return NULL;
+	}
+	
+	n = (SLAB_RUN_SIZE - SLAB_RUN_HEADER) / size;
+	run->size = size;
+	run->nobjs = n;
+	run->nfree = n;
+	run->hint = 0;
+	
+	// objects past the end of the run are marked in use for good
+	for(i = 0; i < SLAB_MAP_WORDS; i++)
+	{
+		if(n >= (i + 1) * 32)
+			run->map[i] = 0;
+		else if(n <= i * 32)
+			run->map[i] = ~0u;
+		else
+			run->map[i] = ~0u << (n - i * 32);
+	}
+	
+	run->prev = NULL;
+	run->next = NULL;
+	arena->slab_runs[c] = run;
+	return run;
+}
+
+/*
+ * slab_unlink - take a run off its class's list of runs with free objects
+ */
+static void slab_unlink(arena_t * arena, slab_run * run, int c)
+{
+	if(run->prev != NULL)
+		run->prev->next = run->next;
+	else
+		arena->slab_runs[c] = run->next;
+	if(run->next != NULL)
+		run->next->prev = run->prev;
+}
+
+/*
+ * slab_malloc - hand out the lowest free object of the run at the head of
+ *  size's class, making a new run if the class has none.
+ */
+static void * slab_malloc(arena_t * arena, size_t size)
+{
+	int c = SLAB_CLASS(size);
+	slab_run * run = arena->slab_runs[c];
+	int i, bit;
+	
+	if(run == NULL && (run = slab_new_run(arena, c)) == NULL)
+		return NULL;
+	
+	for(i = run->hint; run->map[i] == ~0u; i++) {}
+	bit = __builtin_ctz(~run->map[i]);
+	run->map[i] |= 1u << bit;
+	run->hint = i;
+	
+	if(--run->nfree == 0)
+		slab_unlink(arena, run, c);
+	
+	return (char *) run + SLAB_RUN_HEADER + (i * 32 + bit) * run->size;
+}
+
+/*
+ * slab_free - clear ptr's bit in its run. A run that empties is given back
+ *  to the segregated lists unless it is the only one its class has left.
+ */
+static void slab_free(arena_t * arena, slab_run * run, void * ptr)
+{
+	int c = SLAB_CLASS(run->size);
+	int n = ((char *) ptr - (char *) run - SLAB_RUN_HEADER) / run->size;
+	
+	run->map[n / 32] &= ~(1u << (n % 32));
+	if(n / 32 < run->hint)
+		run->hint = n / 32;
+	
+	if(run->nfree++ == 0)
+	{
+		// full runs are not on the list; put it back at the head
+		run->prev = NULL;
+		run->next = arena->slab_runs[c];
+		if(run->next != NULL)
+			run->next->prev = run;
+		arena->slab_runs[c] = run;
+	}
+	else if(run->nfree == run->nobjs && (run->prev != NULL || run->next != NULL))
+	{
+		slab_unlink(arena, run, c);
+		slab_mark(arena, run, 0);
+		free_block(arena, HEADER(run));
+	}
+}
+#endif
+
+/*
+ * block_usable - mm_usable_size of a heap block or slab object
+ */
+static inline size_t block_usable(void * ptr)
+{
+#if SLAB
+	slab_run * run = slab_lookup(ptr);
+	if (run != NULL)
+		return run->size;
+#endif
+	return GET_SIZE(HEADER(ptr)) - SIZE_T_SIZE;
+}
+
+#if STATS
+/*
+ * stat_live - move the live byte count of stats by delta, keeping its peak
+ */
+static inline void stat_live(mm_stats_t * stats, long delta)
+{
+	stats->live_bytes += delta;
+	if (stats->live_bytes > stats->peak_live_bytes)
+		stats->peak_live_bytes = stats->live_bytes;
+}
+#endif
+
+/*
+ * stat_malloc - count ptr, which the arena just handed out
+ */
+static inline void stat_malloc(arena_t * arena, void * ptr)
+{
+#if STATS
+	size_t usable = block_usable(ptr);
+	
+	arena->stats.mallocs[STAT_CLASS(usable)]++;
+	stat_live(&arena->stats, usable);
+#endif
+}
+
+/*
+ * stat_free - count ptr, which is about to go back to the arena
+ */
+static inline void stat_free(arena_t * arena, void * ptr)
+{
+#if STATS
+	size_t usable = block_usable(ptr);
+	
+	arena->stats.frees[STAT_CLASS(usable)]++;
+	stat_live(&arena->stats, -(long) usable);
+#endif
+}
+
+/*
+ * arena_malloc - mm_malloc from one arena, whose lock the caller holds
+ */
+static void * arena_malloc(arena_t * arena, size_t size)
+{
+	arena->requests++;
+	void * ptr;
+	
+#if SLAB
+	if (size <= SLAB_MAX_SIZE && (ptr = slab_malloc(arena, size)) != NULL)
+	{
+		stat_malloc(arena, ptr);
+		return ptr;
+	}
+#endif
+    
+    size_t block_size = ALIGN(size + SIZE_T_SIZE);
+    if (block_size < MIN_BLOCK_SIZE) {block_size = MIN_BLOCK_SIZE;}
+    
+    if ((ptr = block_malloc(arena, block_size)) != NULL)
+		stat_malloc(arena, ptr);
+    return ptr;
+}
+
+/*
+ * carve - cut count blocks of block_size bytes side by side off the front
+ *  of a free block that holds them all, and put their payloads in out.
+ *  What is left over is freed once, at the end.
+ */
+static void carve(arena_t * arena, header * block, size_t block_size, size_t count, void ** out)
+{
+	size_t i;
+	
+	remove_from_freelist(arena, block);
+	for(i = 0; i + 1 < count; i++)
+	{
+		header * next;
+		
+		out[i] = (void *) LOAD(block);
+		next = (header *) ((char *) block + block_size);
+		*next = (GET_SIZE(block) - block_size) | PREV_ALLOC;
+		SET_SIZE(block, block_size);
+		MARK_ALLOCATED(block);
+		if(block == arena->tail)
+			arena->tail = next;
+		block = next;
+	}
+	out[i] = (void *) LOAD(block);
+	STAT_ADD(arena, splits, count - 1);
+	split(arena, block, block_size);
+	set_allocated(arena, block);
+}
+
+/*
+ * arena_malloc_batch - mm_malloc_batch from one arena, whose lock the
+ *  caller holds. Blocks come off the exact small bin while it lasts, and
+ *  the rest are carved out of one free block big enough for all of them
+ *  if there is one, or else a few at a time out of the blocks that fit.
+ *  Returns how many of the n it got.
+ */
+static size_t arena_malloc_batch(arena_t * arena, size_t size, size_t n, void ** out)
+{
+	size_t block_size = ALIGN(size + SIZE_T_SIZE);
+	size_t got = 0, i;
+	int whole = 1;      // no block held the whole run yet
+	header * block;
+	
+	arena->requests += n;
+#if SLAB
+	if (size <= SLAB_MAX_SIZE)
+		while (got < n && (out[got] = slab_malloc(arena, size)) != NULL)
+			got++;
+#endif
+	if (block_size < MIN_BLOCK_SIZE)
+		block_size = MIN_BLOCK_SIZE;
+	
+	if (block_size <= MIN_APPROX_SIZE)
+	{
+		int bin = SMALL_INDEX(block_size);
+		
+		while (got < n && (block = SMALL_FIRST(arena, bin)) != NULL)
+		{
+			remove_from_freelist(arena, block);
+			set_allocated(arena, block);
+			out[got++] = (void *) LOAD(block);
+		}
+	}
+	
+	while (got < n)
+	{
+		size_t count = n - got;
+		
+		if (count > MAX_HEAP / block_size)
+			count = MAX_HEAP / block_size;
+		/*
+		 * one block for the lot, or else whatever free block holds a few;
+		 * once the lot has not fit, stop looking for it, or every pass
+		 * after that would pay for two searches
+		 */
+		block = whole ? find_free(arena, count * block_size) : NULL;
+		if (block == NULL)
 		{
+			whole = 0;
+			block = find_free(arena, block_size);
+		}
+#if !IMMEDIATE_COALESCE
+		if (block == NULL)
+			block = merge(arena, block_size);
+#endif
+		if (block == NULL)
+			block = extend_heap(arena, count * block_size);
+		if (block == NULL)
+			break;
+		if (GET_SIZE(block) / block_size < count)
+			count = GET_SIZE(block) / block_size;
+		carve(arena, block, block_size, count, out + got);
+		got += count;
+	}
+	
+	for (i = 0; i < got; i++)
+		stat_malloc(arena, out[i]);
+	return got;
+}
 
-            return NEXT_FREE(small_free[i]);
-        }
+/*
+ * arena_release - free ptr into the arena that owns it, whose lock the
+ *  caller holds, and return the bytes that went back on its free lists
+ *  (none for a slab object), for the caller to pass on to trim_heap
+ */
+static size_t arena_release(arena_t * arena, void * ptr)
+{
+	size_t size;
+	
+	stat_free(arena, ptr);
+#if SLAB
+	slab_run * run = slab_lookup(ptr);
+	if (run != NULL)
+	{
+		slab_free(arena, run, ptr);
+		return 0;
+	}
+#endif
 
-		i = 0;
-    } else 
+	size = GET_SIZE(HEADER(ptr));
+	free_block(arena, HEADER(ptr));
+	return size;
+}
+
+/*
+ * arena_free - mm_free into the arena that owns ptr, whose lock the caller
+ *  holds
+ */
+static void arena_free(arena_t * arena, void * ptr)
+{
+	trim_heap(arena, arena_release(arena, ptr));
+}
+
+#if TCACHE
+/*
+ * tcache_flush - free a list of cached blocks back to the arenas that own
+ *  them, taking each arena's lock once per run of blocks it owns
+ */
+static void tcache_flush(void * list)
+{
+	arena_t * locked = NULL;
+	
+	while(list != NULL)
+	{
+		void * next = *(void **) list;
+		arena_t * arena = arena_of(list);
+		
+		if(arena != locked)
+		{
+			if(locked != NULL)
+				UNLOCK(locked);
+			LOCK(arena);
+			locked = arena;
+		}
+		arena_free(arena, list);
+		list = next;
+	}
+	if(locked != NULL)
+		UNLOCK(locked);
+}
+
+/*
+ * tcache_release - thread exit: hand everything in the cache back, and the
+ *  cache itself, unless mm_init has started a new heap since
+ */
+static void tcache_release(void * ptr)
+{
+	tcache_t * tc = ptr;
+	arena_t * arena;
+	int c;
+	
+	if(tc->epoch != mm_epoch)
+		return;
+	for(c = 0; c < TCACHE_CLASSES; c++)
+		tcache_flush(tc->head[c]);
+	
+	thread_tcache_epoch = 0;
+	arena = arena_of(tc);
+	LOCK(arena);
+	arena_free(arena, tc);
+	UNLOCK(arena);
+}
+
+static void tcache_key_init(void)
+{
+	pthread_key_create(&tcache_key, tcache_release);
+}
+
+/*
+ * tcache_get - the calling thread's cache, made on its first call after
+ *  mm_init; NULL if there is no room for one
+ */
+static tcache_t * tcache_get(void)
+{
+	if(thread_tcache_epoch != mm_epoch)
 	{
-    	// either no small free blocks exist, or size is too large
-        for(i = 0; i < LARGE_LIST_SIZE; i ++)
+		arena_t * arena = thread_arena_get();
+		tcache_t * tc;
+		
+		LOCK(arena);
+		tc = arena_malloc(arena, sizeof(tcache_t));
+		UNLOCK(arena);
+		if(tc == NULL)
+			return NULL;
+		memset(tc, 0, sizeof(tcache_t));
+		tc->epoch = mm_epoch;
+		
+		pthread_once(&tcache_once, tcache_key_init);
+		pthread_setspecific(tcache_key, tc);
+		thread_tcache = tc;
+		thread_tcache_epoch = mm_epoch;
+	}
+	return thread_tcache;
+}
+
+/*
+ * tcache_malloc - pop a block for size bytes off this thread's cache,
+ *  refilling the class from the thread's arena first if it is empty
+ */
+static void * tcache_malloc(size_t size)
+{
+	tcache_t * tc = tcache_get();
+	int c = TCACHE_CLASS(size);
+	void * ptr;
+	
+	if(tc == NULL)
+		return NULL;
+	
+	if(tc->head[c] == NULL)
+	{
+		arena_t * arena = thread_arena_get();
+		int i;
+		
+		LOCK(arena);
+		for(i = 0; i < TCACHE_BATCH; i++)
 		{
-			if( MIN_APPROX_SIZE << (i + 1) > size )
+			if((ptr = arena_malloc(arena, (c + 1) * ALIGNMENT)) == NULL)
 				break;
+			*(void **) ptr = tc->head[c];
+			tc->head[c] = ptr;
+			tc->count[c]++;
 		}
-    }
-    
-    // find large free block
-    while(i < LARGE_LIST_SIZE)
+#if STATS
+		STAT_ADD(arena, cache_mallocs, tc->hits);
+		STAT_ADD(arena, cache_frees, tc->puts);
+		tc->hits = tc->puts = 0;
+#endif
+		UNLOCK(arena);
+		if(tc->head[c] == NULL)
+			return NULL;
+	}
+	
+	ptr = tc->head[c];
+	tc->head[c] = *(void **) ptr;
+	tc->count[c]--;
+#if STATS
+	tc->hits++;
+#endif
+	return ptr;
+}
+
+/*
+ * tcache_put - push ptr, which holds at least usable bytes, onto this
+ *  thread's cache if that size is cached, flushing the TCACHE_BATCH coldest
+ *  blocks of the class once it overflows. Returns 0 if ptr has to be freed
+ *  the ordinary way.
+ */
+static int tcache_put(void * ptr, size_t usable)
+{
+	tcache_t * tc;
+	int c, i;
+	void * cut;
+	
+	if(usable < ALIGNMENT || usable > TCACHE_MAX_SIZE || (tc = tcache_get()) == NULL)
+		return 0;
+	
+	// a block joins the largest class it can serve
+	c = usable / ALIGNMENT - 1;
+	*(void **) ptr = tc->head[c];
+	tc->head[c] = ptr;
+#if STATS
+	tc->puts++;
+#endif
+	
+	if(++tc->count[c] > TCACHE_COUNT)
+	{
+		for(cut = ptr, i = 1; i < tc->count[c] - TCACHE_BATCH; i++)
+			cut = *(void **) cut;
+		tcache_flush(*(void **) cut);
+		*(void **) cut = NULL;
+		tc->count[c] -= TCACHE_BATCH;
+	}
+	return 1;
+}
+
+/*
+ * tcache_free - tcache_put ptr, reading how much it holds from its header
+ *  (or its slab run)
+ */
+static int tcache_free(void * ptr)
+{
+	size_t usable;
+	
+#if SLAB
+	slab_run * run = slab_lookup(ptr);
+	if(run != NULL)
+		usable = run->size;
+	else
+#endif
+	{
+		/*
+		 * no lock: only the size bits matter, and only whoever holds the block
+		 * changes them (a neighbor may flip PREV_ALLOC under the arena lock)
+		 */
+		header size = __atomic_load_n(HEADER(ptr), __ATOMIC_RELAXED);
+		usable = GET_SIZE(&size) - SIZE_T_SIZE;
+	}
+	return tcache_put(ptr, usable);
+}
+#endif
+
+#if MMAP_THRESHOLD
+/*
+ * MAP_START - the start of the mapping that holds the mapped block at ptr,
+ *  whose header sits in the mapping's first page
+ */
+#define MAP_START(ptr) ((char *) ((unsigned long) HEADER(ptr) & ~(unsigned long) (mem_pagesize() - 1)))
+
+/*
+ * stat_map - count a mapped block at ptr that was just made (delta 1) or
+ *  is about to be unmapped (delta -1)
+ */
+static void stat_map(void * ptr, int delta)
+{
+#if STATS
+	size_t usable = MAP_START(ptr) + GET_SIZE(HEADER(ptr)) - (char *) ptr;
+	
+	pthread_mutex_lock(&map_stats_lock);
+	if (delta > 0)
+	{
+		map_stats.maps++;
+		map_stats.mallocs[STAT_CLASS(usable)]++;
+	} else
+		map_stats.frees[STAT_CLASS(usable)]++;
+	stat_live(&map_stats, delta * (long) usable);
+	pthread_mutex_unlock(&map_stats_lock);
+#endif
+}
+
+/*
+ * map_malloc - serve a large request from a mapping of its own, whose
+ *  length (whole pages) goes in the block header. The payload goes at the
+ *  first align-byte boundary that leaves room for the header, which is
+ *  still in the first page as long as align is at most a page.
+ */
+static void * map_malloc(size_t size, size_t align)
+{
+	size_t page = mem_pagesize();
+	size_t offset = (HEADER_PAD + SIZE_T_SIZE + align - 1) & ~(align - 1);
+	size_t len = (offset + size + page - 1) & ~(page - 1);
+	char * map;
+	header * block;
+	
+	// len would wrap
+	if(size > SIZE_MAX - offset - page)
+		return NULL;
+	if((map = mem_map(len)) == (void *) -1)
+		return NULL;
+	block = (header *) (map + offset - SIZE_T_SIZE);
+	*block = len | 0x1;
+	stat_map(LOAD(block), 1);
+	return (void *) LOAD(block);
+}
+
+/*
+ * map_free - unmap the block at ptr, which map_malloc made
+ */
+static void map_free(void * ptr)
+{
+	stat_map(ptr, -1);
+	mem_unmap(MAP_START(ptr), GET_SIZE(HEADER(ptr)));
+}
+
+/*
+ * map_realloc - resize the mapping of the mapped block at ptr to hold size
+ *  bytes with mem_remap, which moves its pages rather than copying them,
+ *  and return the block's new address, or NULL if that fails
+ */
+static void * map_realloc(void * ptr, size_t size)
+{
+	size_t page = mem_pagesize();
+	char * start = MAP_START(ptr);
+	size_t offset = (char *) ptr - start;
+	size_t len = (offset + size + page - 1) & ~(page - 1);
+	char * map;
+	
+	if(size > SIZE_MAX - offset - page)
+		return NULL;
+	if(len == GET_SIZE(HEADER(ptr)))
+		return ptr;
+	if((map = mem_remap(start, GET_SIZE(HEADER(ptr)), len)) == (void *) -1)
+		return NULL;
+	*(header *) (map + offset - SIZE_T_SIZE) = len | 0x1;
+	return map + offset;
+}
+#endif
+
+#if PROFILE
+/*
+ * profile_now - seconds on the monotonic clock
+ */
+static double profile_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * profile_gap - draw the bytes to allocate before the next sample, from
+ *  an exponential distribution with mean PROFILE_RATE
+ */
+static long profile_gap(void)
+{
+	double u;
+	
+	if (profile_rng == 0)
+		profile_rng = ((unsigned long) &profile_rng ^ (unsigned long long) (profile_now() * 1e9)) | 1;
+	profile_rng ^= profile_rng << 13;
+	profile_rng ^= profile_rng >> 7;
+	profile_rng ^= profile_rng << 17;
+	// uniform on (0, 1]
+	u = ((profile_rng >> 11) + 1) / 9007199254740992.0;
+	return (long) (-log(u) * PROFILE_RATE) + 1;
+}
+
+/*
+ * profile_site_get - the site whose call stack is pcs[0..depth), made if
+ *  there is none and the table has room, or NULL
+ */
+static profile_site * profile_site_get(void ** pcs, int depth)
+{
+	unsigned long h = depth;
+	unsigned int i;
+	int j;
+	
+	for (j = 0; j < depth; j++)
+		h = h * 31 + (unsigned long) pcs[j];
+	for (i = PROFILE_HASH(h << 3, PROFILE_SITE_BITS); ; i = (i + 1) & (PROFILE_SITES - 1))
+	{
+		profile_site * site = &profile_sites[i];
+		
+		if (site->depth == 0)
+		{
+			// keep a quarter of the slots empty so misses end quickly
+			if (profile_nsites >= PROFILE_SITES / 4 * 3)
+				return NULL;
+			profile_nsites++;
+			memcpy(site->pcs, pcs, depth * sizeof(void *));
+			site->depth = depth;
+			return site;
+		}
+		if (site->depth == depth && memcmp(site->pcs, pcs, depth * sizeof(void *)) == 0)
+			return site;
+	}
+}
+
+/*
+ * profile_record - called once the countdown runs out on ptr, a block of
+ *  size bytes just handed out: draw the next gap and, unless this is the
+ *  thread's first draw, record the block with its caller's call stack
+ */
+static __attribute__((noinline)) void profile_record(void * ptr, size_t size)
+{
+	void * pcs[PROFILE_DEPTH + 2];
+	int first = profile_rng == 0;
+	int depth;
+	profile_site * site;
+	unsigned int i;
+	
+	if (profile_busy)
+		return;
+	profile_busy = 1;
+	profile_countdown = profile_gap();
+	if (first)
+	{
+		profile_busy = 0;
+		return;
+	}
+	
+	// skip this function and the mm_* entry point that called it
+	depth = backtrace(pcs, PROFILE_DEPTH + 2) - 2;
+	if (depth < 1)
+	{
+		pcs[2] = NULL;
+		depth = 1;
+	}
+	
+	pthread_mutex_lock(&profile_lock);
+	site = profile_site_get(pcs + 2, depth);
+	if (site == NULL || profile_nlive >= PROFILE_LIVE / 4 * 3)
+		profile_dropped++;
+	else
+	{
+		for (i = PROFILE_HASH(ptr, PROFILE_LIVE_BITS); profile_live[i].ptr != NULL; i = (i + 1) & (PROFILE_LIVE - 1)) {}
+		profile_live[i].ptr = ptr;
+		profile_live[i].size = size;
+		profile_live[i].born = profile_now();
+		profile_live[i].site = site;
+		profile_nlive++;
+		profile_filter[PROFILE_HASH(ptr, PROFILE_FILTER_BITS)]++;
+		site->live_count++;
+		site->live_bytes += size;
+		site->alloc_count++;
+		site->alloc_bytes += size;
+	}
+	pthread_mutex_unlock(&profile_lock);
+	profile_busy = 0;
+}
+
+/*
+ * profile_free - drop the sample of ptr, which is being freed, if it has
+ *  one, crediting its lifetime to its site
+ */
+static void profile_free(void * ptr)
+{
+	unsigned int i, j, home;
+	
+	if (profile_busy)
+		return;
+	pthread_mutex_lock(&profile_lock);
+	for (i = PROFILE_HASH(ptr, PROFILE_LIVE_BITS); profile_live[i].ptr != NULL; i = (i + 1) & (PROFILE_LIVE - 1))
+		if (profile_live[i].ptr == ptr)
+			break;
+	if (profile_live[i].ptr != NULL)
 	{
-        if (NEXT_FREE(large_free[i]) != NULL)
+		profile_site * site = profile_live[i].site;
+		
+		site->live_count--;
+		site->live_bytes -= profile_live[i].size;
+		site->freed_count++;
+		site->lifetime += profile_now() - profile_live[i].born;
+		profile_nlive--;
+		profile_filter[PROFILE_HASH(ptr, PROFILE_FILTER_BITS)]--;
+		
+		// shift later entries of the probe run back over the hole
+		for (j = (i + 1) & (PROFILE_LIVE - 1); profile_live[j].ptr != NULL; j = (j + 1) & (PROFILE_LIVE - 1))
 		{
-            header * current = NEXT_FREE(large_free[i]);
-            while (current != NULL)
+			home = PROFILE_HASH(profile_live[j].ptr, PROFILE_LIVE_BITS);
+			if (((j - home) & (PROFILE_LIVE - 1)) >= ((j - i) & (PROFILE_LIVE - 1)))
 			{
-                if (GET_SIZE(current) >= size)
-				{
-                   
-                    return current;
-                }
-                current = NEXT_FREE(current);
-            }
-        }
-		i++;
-    }
+				profile_live[i] = profile_live[j];
+				i = j;
+			}
+		}
+		profile_live[i].ptr = NULL;
+	}
+	pthread_mutex_unlock(&profile_lock);
+}
+#endif
+
+/*
+ * profiled - count size bytes just handed out at ptr against this thread's
+ *  sampling countdown, and return ptr
+ */
+static inline void * profiled(void * ptr, size_t size)
+{
+#if PROFILE
+	if ((profile_countdown -= (long) size) < 0 && ptr != NULL)
+		profile_record(ptr, size);
+#endif
+	return ptr;
+}
+
+/*
+ * unprofile - forget ptr, which is about to be freed, if it was sampled
+ */
+static inline void unprofile(void * ptr)
+{
+#if PROFILE
+	if (__atomic_load_n(&profile_filter[PROFILE_HASH(ptr, PROFILE_FILTER_BITS)], __ATOMIC_RELAXED))
+		profile_free(ptr);
+#endif
+}
+
+/* 
+ * mm_malloc - Allocate a block by finding a free node in one of the segmented
+ *     lists. Always allocate a block whose size is a multiple of the alignment.
+ *     With SLAB, small requests come out of a slab run instead, and with
+ *     MULTI_ARENA it all happens in the calling thread's arena. TCACHE
+ *     serves small requests from the thread's cache before any of that,
+ *     and requests of MMAP_THRESHOLD bytes or more are mapped on their own.
+ */
+void *mm_malloc(size_t size)
+{
+	arena_t * arena;
+	void * ptr;
+	
+	if (size > MAX_REQUEST)
+		return NULL;
+#if MMAP_THRESHOLD
+	if (size >= MMAP_THRESHOLD)
+		return profiled(map_malloc(size, ALIGNMENT), size);
+#endif
+#if TCACHE
+	if (size <= TCACHE_MAX_SIZE && (ptr = tcache_malloc(size)) != NULL)
+		return profiled(ptr, size);
+#endif
+	
+	arena = thread_arena_get();
+	LOCK(arena);
+	ptr = arena_malloc(arena, size);
+	UNLOCK(arena);
+	return profiled(ptr, size);
+}
+
+
+/*
+ * mm_free - Free a block by marking it as free and putting it back into
+ *  one of the free lists (joining it with its free neighbors first when
+ *  built with IMMEDIATE_COALESCE). The block goes back to the arena that
+ *  owns it, whichever thread frees it; with TCACHE, small blocks stop in
+ *  the freeing thread's cache first.
+ */
+void mm_free(void *ptr)
+{
+	arena_t * arena;
+	
+	unprofile(ptr);
+#if MMAP_THRESHOLD
+	if (IS_MAPPED(ptr))
+	{
+		map_free(ptr);
+		return;
+	}
+#endif
+#if TCACHE
+	if (tcache_free(ptr))
+		return;
+#endif
     
- 
-    return NULL;
+	arena = arena_of(ptr);
+	LOCK(arena);
+	arena_free(arena, ptr);
+	UNLOCK(arena);
 }
 
-header * merge(size_t size)
+/*
+ * mm_free_sized - mm_free for a caller that knows ptr was asked for size
+ *  bytes (or fewer than it holds). With TCACHE the size alone picks the
+ *  cache class, so the block's header is not read on that path. Without
+ *  TCACHE the size is ignored: freeing the block has to load and rewrite
+ *  its header anyway. Builds without NDEBUG check the size against
+ *  mm_usable_size first.
+ */
+void mm_free_sized(void *ptr, size_t size)
 {
+	arena_t * arena;
+	
+	assert(size <= mm_usable_size(ptr));
+	unprofile(ptr);
+#if MMAP_THRESHOLD
+	if (IS_MAPPED(ptr))
+	{
+		map_free(ptr);
+		return;
+	}
+#endif
+#if TCACHE
+	if (tcache_put(ptr, SIZED_USABLE(size)))
+		return;
+#endif
+	
+	arena = arena_of(ptr);
+	LOCK(arena);
+	arena_free(arena, ptr);
+	UNLOCK(arena);
+}
 
-    int i = MIN_BLOCK_SIZE / ALIGNMENT - 1;
-    for (; i < SMALL_LIST_SIZE + LARGE_LIST_SIZE - 1; i++)
+/*
+ * mm_usable_size - how many bytes the block at ptr can really hold, which
+ *  may be more than it was asked for
+ */
+size_t mm_usable_size(void *ptr)
+{
+#if MMAP_THRESHOLD
+	if (IS_MAPPED(ptr))
+		return MAP_START(ptr) + GET_SIZE(HEADER(ptr)) - (char *) ptr;
+#endif
+	return block_usable(ptr);
+}
+
+/*
+ * mm_malloc_batch - allocate n blocks of size bytes each into out, taking
+ *  the arena's lock once and carving them out of one free block where it
+ *  can, and return how many it got (fewer than n only when out of memory).
+ *  The blocks skip TCACHE both ways and are freed like any others.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+	arena_t * arena;
+	size_t got = 0;
+	
+	if (size > MAX_REQUEST)
+		return 0;
+#if MMAP_THRESHOLD
+	if (size >= MMAP_THRESHOLD)
 	{
-        header * current = NEXT_FREE(small_free[i]);
-        header * next;
-        
-        while (current != NULL)
+		while (got < n && (out[got] = profiled(map_malloc(size, ALIGNMENT), size)) != NULL)
+			got++;
+		return got;
+	}
+#endif
+	
+	arena = thread_arena_get();
+	LOCK(arena);
+	got = arena_malloc_batch(arena, size, n, out);
+	UNLOCK(arena);
+#if PROFILE
+	size_t i;
+	
+	for (i = 0; i < got; i++)
+		profiled(out[i], size);
+#endif
+	return got;
+}
+
+/*
+ * mm_free_batch - free the n blocks in ptrs, taking each arena's lock once
+ *  per run of blocks it owns and trimming the heap once per run
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+	arena_t * locked = NULL;
+	size_t freed = 0;
+	size_t i;
+	
+	for (i = 0; i < n; i++)
+	{
+		arena_t * arena;
+		
+		unprofile(ptrs[i]);
+#if MMAP_THRESHOLD
+		if (IS_MAPPED(ptrs[i]))
 		{
-            next = NEXT(current);
-            if (next != NULL && next < heap_high && 
-				GET_SIZE(next) >= MIN_BLOCK_SIZE && 
-				(long unsigned int) IS_ALLOCATED(next) == 0)
-			{
-                
-                
-                
-                remove_from_linked_list(current);                
-                remove_from_linked_list(next);
-                
-                *current += *next;
-                add_to_freelist(current);
-                
-                if (size && *current >= size)
-                    return current;
-            } else
+			map_free(ptrs[i]);
+			continue;
+		}
+#endif
+		arena = arena_of(ptrs[i]);
+		if (arena != locked)
+		{
+			if (locked != NULL)
 			{
-                current = NEXT_FREE(current);
-            }
-        }
-    }
-
-	return NULL;
+				trim_heap(locked, freed);
+				UNLOCK(locked);
+			}
+			LOCK(arena);
+			locked = arena;
+			freed = 0;
+		}
+		freed += arena_release(arena, ptrs[i]);
+	}
+	if (locked != NULL)
+	{
+		trim_heap(locked, freed);
+		UNLOCK(locked);
+	}
 }
 
+/*
+ * mm_memalign - allocate size bytes whose address is a multiple of
+ *  alignment, a power of two, or return NULL if it is not one. The block
+ *  is cut out of a free block (or new memory) at the aligned spot, and the
+ *  slack on either side goes back on the free lists, so mm_free and
+ *  mm_realloc treat it like any other block.
+ */
+void *mm_memalign(size_t alignment, size_t size)
+{
+	arena_t * arena;
+	void * ptr;
+	size_t block_size;
+	
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+		return NULL;
+	if (size > MAX_REQUEST || alignment > MAX_REQUEST)
+		return NULL;
+	if (alignment <= ALIGNMENT)
+		return mm_malloc(size);
+	
+#if MMAP_THRESHOLD
+	if (size >= MMAP_THRESHOLD && alignment <= mem_pagesize())
+		return profiled(map_malloc(size, alignment), size);
+#endif
+	
+	block_size = ALIGN(size + SIZE_T_SIZE);
+	if (block_size < MIN_BLOCK_SIZE)
+		block_size = MIN_BLOCK_SIZE;
+	
+	arena = thread_arena_get();
+	LOCK(arena);
+	if ((ptr = block_malloc_aligned(arena, block_size, alignment)) != NULL)
+		stat_malloc(arena, ptr);
+	UNLOCK(arena);
+	return profiled(ptr, size);
+}
 
-
-/* 
- * mm_malloc - Allocate a block by finding a free node in one of the segmented
- *     lists. Always allocate a block whose size is a multiple of the alignment.
+/*
+ * mm_calloc - allocate zeroed memory for nmemb objects of size bytes each,
+ *  or return NULL if that overflows or exceeds MAX_REQUEST. A block that lies above the arena's
+ *  zero_start, or a mapping, is fresh from the OS and zero already but for
+ *  the links and footer it had as a free block, so only those are cleared.
  */
-void *mm_malloc(size_t size)
+void *mm_calloc(size_t nmemb, size_t size)
 {
+	size_t bytes = nmemb * size;
+	arena_t * arena;
+	char * zero_start;
+	header * block;
+	void * ptr;
+	
+	if (size != 0 && bytes / size != nmemb)
+		return NULL;
+	if (bytes > MAX_REQUEST)
+		return NULL;
+	
+#if MMAP_THRESHOLD
+	if (bytes >= MMAP_THRESHOLD)
+		return profiled(map_malloc(bytes, ALIGNMENT), bytes);
+#endif
+#if TCACHE
+	// cached blocks have been used, so there is nothing to save
+	if (bytes <= TCACHE_MAX_SIZE)
+	{
+		if ((ptr = mm_malloc(bytes)) != NULL)
+			memset(ptr, 0, bytes);
+		return ptr;
+	}
+#endif
+	
+	arena = thread_arena_get();
+	LOCK(arena);
+	zero_start = arena->zero_start;
+	ptr = arena_malloc(arena, bytes);
+	UNLOCK(arena);
+	if (ptr == NULL)
+		return NULL;
+	profiled(ptr, bytes);
+	
+	block = HEADER(ptr);
+#if SLAB
+	if (slab_lookup(ptr) != NULL)
+		block = NULL;
+#endif
+	if (block == NULL || (char *) block < zero_start)
+	{
+		memset(ptr, 0, bytes);
+		return ptr;
+	}
+	
+	memset(ptr, 0, bytes < FREE_LINKS_SIZE ? bytes : FREE_LINKS_SIZE);
+#if IMMEDIATE_COALESCE
+	*FOOTER(block) = 0;
+#endif
+	return ptr;
+}
 
-    
-    size_t block_size = ALIGN(size + SIZE_T_SIZE);
-    if (block_size < MIN_BLOCK_SIZE) {block_size = MIN_BLOCK_SIZE;}
-    
-   
-    header * block = find_free(block_size);
-    
- 
-    if(block == NULL)
-    {
-		
-		block = merge(block_size);
+/*
+ * copy_bytes - memcpy for mm_realloc. From STREAM_COPY_MIN bytes up, with
+ *  SSE2, the bulk goes through non-temporal stores that bypass the cache,
+ *  since the old block is about to be freed and the new one is too big to
+ *  stay cached anyway.
+ */
+static void copy_bytes(void * to, const void * from, size_t n)
+{
+#ifdef __SSE2__
+	if (STREAM_COPY_MIN && n >= STREAM_COPY_MIN)
+	{
+		char * d = to;
+		const char * s = from;
+		// store up to a 16-byte boundary of the target the ordinary way
+		size_t head = -(unsigned long) d & 15;
 		
-        if (block != NULL) {
-
-        }
-        
-        
-        else
+		memcpy(d, s, head);
+		d += head;
+		s += head;
+		n -= head;
+		for (; n >= 64; n -= 64, d += 64, s += 64)
 		{
-            
-            
-            
-            for( ; block_size > sbrkCount; sbrkCount = sbrkCount*2) {}
-            
-            // sbrk more memory and add it to the free lists
-            block = mem_sbrk(sbrkCount);
-            heap_high = mem_heap_hi();
-            *block = (header) heap_high - (header) block + 1;
-            MARK_FREE(block);
-            add_to_freelist(block);
-            
-           
-        }
-    }
-    
-	// we are sure block is of sufficient size, so we can allocate
-    void * ptr = allocate(block, block_size);
-
-    return ptr;
+			__m128i a = _mm_loadu_si128((const __m128i *) s);
+			__m128i b = _mm_loadu_si128((const __m128i *) (s + 16));
+			__m128i c = _mm_loadu_si128((const __m128i *) (s + 32));
+			__m128i e = _mm_loadu_si128((const __m128i *) (s + 48));
+			
+			_mm_stream_si128((__m128i *) d, a);
+			_mm_stream_si128((__m128i *) (d + 16), b);
+			_mm_stream_si128((__m128i *) (d + 32), c);
+			_mm_stream_si128((__m128i *) (d + 48), e);
+		}
+		// streamed stores are weakly ordered; finish them before the block is used
+		_mm_sfence();
+		memcpy(d, s, n);
+		return;
+	}
+#endif
+	memcpy(to, from, n);
 }
 
-
 /*
- * mm_free - Free a block by marking it as free and putting it back into
- *  one of the free lists.
+ * realloc_keep - how big mm_realloc should leave a block it resizes to
+ *  block_size bytes: that, plus half as much again for a block that has
+ *  grown REALLOC_STREAK times. A grow counts towards that.
  */
-void mm_free(void *ptr)
+static size_t realloc_keep(arena_t * arena, header * block, size_t block_size, int grow)
 {
-    header * block = HEADER(ptr);
+#if REALLOC_STREAK
+	unsigned int slot = TRACK_SLOT(block);
+	
+	if (grow)
+	{
+		if (arena->grown[slot].block != block)
+		{
+			arena->grown[slot].block = block;
+			arena->grown[slot].grows = 0;
+		}
+		arena->grown[slot].grows++;
+	}
+	if (arena->grown[slot].block == block && arena->grown[slot].grows >= REALLOC_STREAK)
+		return ALIGN(block_size + block_size / 2);
+#endif
+	return block_size;
+}
 
-	MARK_FREE(block);
-	add_to_freelist(block);
+/*
+ * realloc_track - carry the streak of a block that mm_realloc moved over
+ *  to its new place at ptr, in the arena that now owns it
+ */
+static void realloc_track(void * ptr, unsigned int grows)
+{
+#if REALLOC_STREAK
+	arena_t * arena;
 	
+	if (ptr == NULL)
+		return;
+#if MMAP_THRESHOLD
+	// a mapping grows by remapping, which needs no headroom
+	if (IS_MAPPED(ptr))
+		return;
+#endif
+	arena = arena_of(ptr);
+	LOCK(arena);
+	arena->grown[TRACK_SLOT(HEADER(ptr))].block = HEADER(ptr);
+	arena->grown[TRACK_SLOT(HEADER(ptr))].grows = grows;
+	UNLOCK(arena);
+#else
+	(void) ptr;
+	(void) grows;
+#endif
+}
+
+/*
+ * realloc_copy - the malloc/copy/free fallback of mm_realloc, where ptr's
+ *  block holds copySize bytes
+ */
+static void * realloc_copy(void * ptr, size_t size, size_t copySize)
+{
+	void * newptr = mm_malloc(size);
+	if (newptr == NULL)
+		return NULL;
+	if (size < copySize)
+		copySize = size;
+	copy_bytes(newptr, ptr, copySize);
+	mm_free(ptr);
+	return newptr;
 }
 
 /*
@@ -408,6 +3785,7 @@ void *mm_realloc(void *ptr, size_t size)
 {
     void * ptr_old = ptr;    
     header * block_old = HEADER(ptr);
+	arena_t * arena;
     
     size_t block_size = ALIGN(size + SIZE_T_SIZE);
     if (block_size < MIN_BLOCK_SIZE)
@@ -419,57 +3797,606 @@ void *mm_realloc(void *ptr, size_t size)
         mm_free(ptr);
         return NULL;
     }
-    else if (block_size > GET_SIZE(block_old))
+    if (size > MAX_REQUEST)
+		return NULL;
+    
+#if MMAP_THRESHOLD
+	// a mapping stays one while the new size is large, and is remapped to fit it
+	if (IS_MAPPED(ptr))
+	{
+		size_t copySize = MAP_START(ptr) + GET_SIZE(block_old) - (char *) ptr;
+		void * moved = size >= MMAP_THRESHOLD ? map_realloc(ptr, size) : NULL;
+		
+#if STATS
+		pthread_mutex_lock(&map_stats_lock);
+		if (moved != NULL)
+		{
+			map_stats.realloc_in_place++;
+			stat_live(&map_stats, (long) (MAP_START(moved) + GET_SIZE(HEADER(moved)) - (char *) moved) - (long) copySize);
+		}
+		else
+			map_stats.realloc_copies++;
+		pthread_mutex_unlock(&map_stats_lock);
+#endif
+		if (moved == NULL)
+			return realloc_copy(ptr, size, copySize);
+		if (moved != ptr)
+		{
+			unprofile(ptr);
+			moved = profiled(moved, size);
+		}
+		return moved;
+	}
+#endif
+	arena = arena_of(ptr);
+	LOCK(arena);
+#if SLAB
+	// a slab object keeps its slot if the new size still fits the class
+	slab_run * run = slab_lookup(ptr);
+	if (run != NULL)
+	{
+		size_t copySize = run->size;
+		
+		if (size <= copySize)
+		{
+			STAT(arena, realloc_in_place);
+			UNLOCK(arena);
+			return ptr;
+		}
+		STAT(arena, realloc_copies);
+		UNLOCK(arena);
+		return realloc_copy(ptr, size, copySize);
+	}
+#endif
+    size_t old_size = GET_SIZE(block_old);
+    size_t keep;
+    
+    if (block_size > GET_SIZE(block_old))
 	{
+        keep = realloc_keep(arena, block_old, block_size, 1);
+        
         // try to merge first,
         header * next = NEXT(block_old);
-        while(next != NULL && GET_SIZE(next) >= MIN_BLOCK_SIZE 
-			  && next < heap_high && IS_ALLOCATED(next) == 0)
+        while(next != NULL && block_old != arena->tail
+			  && GET_SIZE(next) >= MIN_BLOCK_SIZE && IS_ALLOCATED(next) == 0)
 		{
+			remove_from_freelist(arena, next);
             *block_old += GET_SIZE(next);
-			remove_from_linked_list(next);
+            if (next == arena->tail)
+                arena->tail = block_old;
             next = NEXT(block_old);
+            STAT(arena, blocks_merged);
         }
+#if !MULTI_ARENA
+        // the wilderness block grows over new memory without moving
+        if (block_size > GET_SIZE(block_old) && block_old == arena->tail &&
+			block_size - GET_SIZE(block_old) <= INT_MAX &&
+			mem_sbrk(block_size - GET_SIZE(block_old)) != (void *) -1)
+		{
+            arena->footprint += block_size - GET_SIZE(block_old);
+            STAT(arena, sbrks);
+            STAT_ADD(arena, sbrk_bytes, block_size - GET_SIZE(block_old));
+            SET_SIZE(block_old, block_size);
+		}
+#endif
+        set_allocated(arena, block_old);
         
         // if merge didn't get enough, then have to malloc/copy, & we're done
         if (block_size > GET_SIZE(block_old))
 		{
-            void * newptr = mm_malloc(size);
-            if (newptr == NULL)
-                return NULL;
-            size_t copySize = *(size_t *)((char *)ptr_old - SIZE_T_SIZE);
-            if (size < copySize)
-                copySize = size;
-            memcpy(newptr, ptr_old, copySize);
-            mm_free(ptr_old);
-            return newptr;
+            size_t copySize = GET_SIZE(block_old) - SIZE_T_SIZE;
+            unsigned int grows = 0;
+            void * moved;
+            
+#if REALLOC_STREAK
+            grows = arena->grown[TRACK_SLOT(block_old)].grows;
+            arena->grown[TRACK_SLOT(block_old)].block = NULL;
+#endif
+            STAT_LIVE(arena, (long) GET_SIZE(block_old) - (long) old_size);
+            STAT(arena, realloc_copies);
+			UNLOCK(arena);
+            moved = realloc_copy(ptr_old, keep - SIZE_T_SIZE, copySize);
+            // without the headroom it may still fit
+            if (moved == NULL && keep > block_size)
+                moved = realloc_copy(ptr_old, size, copySize);
+            realloc_track(moved, grows);
+            return moved;
         }
     }
+    else
+        keep = realloc_keep(arena, block_old, block_size, 0);
         
-    // If new block size is less than old, we just split off remainder and mark it as free
-    if (block_size <= GET_SIZE(block_old))
-	{
-        size_t split_size = block_size - size;
-        
-        if(split_size >= MIN_BLOCK_SIZE) {
-            // split the block in two
-            *block_old = block_size;
-            header * split = NEXT(block_old); //second half of the split block
-            *split = split_size;
-            
-            // add split block to free list
-            MARK_FREE(split);
-            add_to_freelist(split);
-        } 
-    }
+    // give back what is left past block_size (and any headroom)
+    if (keep < GET_SIZE(block_old))
+        split(arena, block_old, keep);
     
-    MARK_ALLOCATED(block_old);
+    set_allocated(arena, block_old);
+    STAT_LIVE(arena, (long) GET_SIZE(block_old) - (long) old_size);
+    STAT(arena, realloc_in_place);
+	UNLOCK(arena);
     return ptr_old;
 }
 
+/*
+ * handle_new - take a free entry from the handle table, growing it if
+ *  there is none, and return its index, or 0 when out of memory. The
+ *  caller holds handle_lock.
+ */
+static size_t handle_new(void)
+{
+	size_t h;
+	
+	if(handles_free != 0)
+	{
+		h = handles_free;
+		handles_free = handles[h].pins;
+		return h;
+	}
+	if(handles_used + 1 >= handles_len)
+	{
+		size_t len = handles_len ? 2 * handles_len : HANDLES_MIN;
+		handle_entry * table = mem_map(len * sizeof(handle_entry));
+		
+		if(table == (void *) -1)
+			return 0;
+		if(handles != NULL)
+		{
+			memcpy(table, handles, handles_len * sizeof(handle_entry));
+			mem_unmap(handles, handles_len * sizeof(handle_entry));
+		}
+		handles = table;
+		handles_len = len;
+	}
+	return ++handles_used;
+}
+
+/*
+ * handle_drop - put entry h back on the table's free list. The caller
+ *  holds handle_lock.
+ */
+static void handle_drop(size_t h)
+{
+	handles[h].block = NULL;
+	handles[h].pins = handles_free;
+	handles_free = h;
+}
+
+/*
+ * mm_halloc - allocate a block of size bytes that mm_compact may move,
+ *  and return its handle, or 0 when out of memory. When the heap cannot
+ *  grow, it compacts the heap and tries again. Handle blocks are always
+ *  ordinary heap blocks, never slab objects, cached or mapped.
+ */
+mm_handle_t mm_halloc(size_t size)
+{
+	arena_t * arena = thread_arena_get();
+	size_t block_size;
+	void * ptr;
+	size_t h;
+	
+	if(size > MAX_REQUEST)
+		return 0;
+	block_size = ALIGN(size + HANDLE_PREFIX + SIZE_T_SIZE);
+	if(block_size < MIN_BLOCK_SIZE)
+		block_size = MIN_BLOCK_SIZE;
+	
+	HANDLE_LOCK();
+	if((h = handle_new()) == 0)
+	{
+		HANDLE_UNLOCK();
+		return 0;
+	}
+	LOCK(arena);
+	arena->requests++;
+	ptr = block_malloc(arena, block_size);
+#if !MULTI_ARENA
+	if(ptr == NULL)
+	{
+		arena_compact(arena);
+		ptr = block_malloc(arena, block_size);
+	}
+#endif
+	if(ptr != NULL)
+	{
+		stat_malloc(arena, ptr);
+		*HEADER(ptr) |= HANDLE_BLOCK;
+		*(size_t *) ptr = h;
+		handles[h].block = HEADER(ptr);
+		handles[h].pins = 0;
+	}
+	else
+		handle_drop(h);
+	UNLOCK(arena);
+	HANDLE_UNLOCK();
+	return ptr == NULL ? 0 : h;
+}
+
+/*
+ * mm_hfree - free the block of a handle from mm_halloc, which must not
+ *  be pinned, and the handle with it. Freeing handle 0 does nothing.
+ */
+void mm_hfree(mm_handle_t handle)
+{
+	arena_t * arena;
+	header * block;
+	
+	if(handle == 0)
+		return;
+	HANDLE_LOCK();
+	block = handles[handle].block;
+	assert(handles[handle].pins == 0);
+	handle_drop(handle);
+	HANDLE_UNLOCK();
+	
+	arena = arena_of(LOAD(block));
+	LOCK(arena);
+	*block &= ~HANDLE_BLOCK;
+	arena_free(arena, (void *) LOAD(block));
+	UNLOCK(arena);
+}
+
+/*
+ * mm_pin - the address of a handle's block, which stays put until the
+ *  matching mm_unpin
+ */
+void *mm_pin(mm_handle_t handle)
+{
+	void * ptr;
+	
+	HANDLE_LOCK();
+	handles[handle].pins++;
+	ptr = (char *) LOAD(handles[handle].block) + HANDLE_PREFIX;
+	HANDLE_UNLOCK();
+	return ptr;
+}
+
+/*
+ * mm_unpin - undo one mm_pin of a handle
+ */
+void mm_unpin(mm_handle_t handle)
+{
+	HANDLE_LOCK();
+	assert(handles[handle].pins > 0);
+	handles[handle].pins--;
+	HANDLE_UNLOCK();
+}
+
+/*
+ * mm_compact - move unpinned handle blocks down the heap over the free
+ *  space below them and give the free space this leaves at the top back
+ *  to memlib. Returns how many bytes went back. In MULTI_ARENA mode the
+ *  arenas share the heap in interleaved spans, so nothing moves.
+ */
+size_t mm_compact(void)
+{
+#if MULTI_ARENA
+	return 0;
+#else
+	return arena_compact(&main_arena);
+#endif
+}
+
+/*
+ * a chunk of a region: an mm_malloc block that starts with this header,
+ * after which come size bytes for the region to bump through
+ */
+typedef struct region_chunk {
+	struct region_chunk * next;
+	size_t size;
+} region_chunk;
+
+#define CHUNK_HEADER ALIGN(sizeof(region_chunk))
+#define CHUNK_START(chunk) ((char *) (chunk) + CHUNK_HEADER)
+
+struct mm_region {
+	char * next;            // the next free byte of the current chunk
+	char * end;             // the end of the current chunk
+	region_chunk * chunks;  // every chunk, the current one first
+};
+
+/*
+ * region_chunk_new - mm_malloc a chunk with room for size bytes, or
+ *  return NULL
+ */
+static region_chunk * region_chunk_new(size_t size)
+{
+	region_chunk * chunk = mm_malloc(CHUNK_HEADER + size);
+	
+	if(chunk != NULL)
+		chunk->size = size;
+	return chunk;
+}
+
+/*
+ * mm_region_create - a new, empty region, or NULL when out of memory
+ */
+mm_region_t *mm_region_create(void)
+{
+	mm_region_t * region = mm_malloc(sizeof(mm_region_t));
+	
+	if(region != NULL)
+	{
+		region->next = region->end = NULL;
+		region->chunks = NULL;
+	}
+	return region;
+}
+
+/*
+ * mm_region_alloc - size bytes from the region, bumped off its current
+ *  chunk. A request bigger than a quarter of a chunk gets a chunk of its
+ *  own, linked in behind the current one so that what is left of that
+ *  one is not lost. Returns NULL when out of memory.
+ */
+void *mm_region_alloc(mm_region_t *region, size_t size)
+{
+	region_chunk * chunk;
+	void * ptr;
+	
+	// rounding it up, or adding the chunk header, would wrap
+	if(size > MAX_REQUEST - CHUNK_HEADER)
+		return NULL;
+	// an empty request still gets a byte of its own
+	size = size ? ALIGN(size) : ALIGNMENT;
+	if(size <= (size_t) (region->end - region->next))
+	{
+		ptr = region->next;
+		region->next += size;
+		return ptr;
+	}
+	
+	if(size > REGION_CHUNK / 4)
+	{
+		if((chunk = region_chunk_new(size)) == NULL)
+			return NULL;
+		if(region->chunks != NULL)
+		{
+			chunk->next = region->chunks->next;
+			region->chunks->next = chunk;
+			return CHUNK_START(chunk);
+		}
+	}
+	else if((chunk = region_chunk_new(REGION_CHUNK)) == NULL)
+		return NULL;
+	
+	chunk->next = region->chunks;
+	region->chunks = chunk;
+	region->next = CHUNK_START(chunk) + size;
+	region->end = CHUNK_START(chunk) + chunk->size;
+	return CHUNK_START(chunk);
+}
+
+/*
+ * mm_region_reset - free everything allocated from the region at once.
+ *  The oldest chunk is kept for the region to start over in, provided it
+ *  is an ordinary one; the rest go back with mm_free, one call per chunk.
+ */
+void mm_region_reset(mm_region_t *region)
+{
+	region_chunk * chunk = region->chunks;
+	region_chunk * keep = NULL;
+	
+	while(chunk != NULL)
+	{
+		region_chunk * next = chunk->next;
+		
+		if(next == NULL && chunk->size == REGION_CHUNK)
+			keep = chunk;
+		else
+			mm_free(chunk);
+		chunk = next;
+	}
+	
+	region->chunks = keep;
+	if(keep != NULL)
+	{
+		region->next = CHUNK_START(keep);
+		region->end = CHUNK_START(keep) + keep->size;
+	}
+	else
+		region->next = region->end = NULL;
+}
+
+/*
+ * mm_region_destroy - free the region and everything allocated from it
+ */
+void mm_region_destroy(mm_region_t *region)
+{
+	mm_region_reset(region);
+	if(region->chunks != NULL)
+		mm_free(region->chunks);
+	mm_free(region);
+}
 
+#if STATS
+/*
+ * stat_sum - add the counters in from to those in to
+ */
+static void stat_sum(mm_stats_t * to, mm_stats_t * from)
+{
+	// every field is an unsigned long
+	unsigned long * t = (unsigned long *) to;
+	unsigned long * f = (unsigned long *) from;
+	size_t i;
+	
+	for (i = 0; i < sizeof(mm_stats_t) / sizeof(unsigned long); i++)
+		t[i] += f[i];
+}
+#endif
 
+/*
+ * mm_stats - fill in stats with the counters of every arena (and of the
+ *  mapped blocks) added together, or all zeros in a STATS=0 build. With
+ *  several arenas the peak is the sum of each arena's peak, which is an
+ *  upper bound. With TCACHE, mallocs and frees count what reached the
+ *  arenas, including cache refills and flushes, and cache_mallocs and
+ *  cache_frees what the thread caches served, as of their last refill.
+ */
+void mm_stats(mm_stats_t *stats)
+{
+	memset(stats, 0, sizeof(mm_stats_t));
+#if STATS
+#if MULTI_ARENA
+	int i;
+	
+	for (i = 0; i < NARENAS; i++)
+	{
+		arena_t * arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+		
+		if (arena == NULL)
+			continue;
+		LOCK(arena);
+		stat_sum(stats, &arena->stats);
+		UNLOCK(arena);
+	}
+#else
+	stat_sum(stats, &main_arena.stats);
+#endif
+#if MMAP_THRESHOLD
+	pthread_mutex_lock(&map_stats_lock);
+	stat_sum(stats, &map_stats);
+	pthread_mutex_unlock(&map_stats_lock);
+#endif
+#endif
+}
 
+/*
+ * mm_profile_dump - write the heap profile to out (see mm.h), or return
+ *  -1 in a build without PROFILE
+ */
+int mm_profile_dump(FILE *out)
+{
+#if PROFILE
+	unsigned long live_count = 0, live_bytes = 0;
+	unsigned long alloc_count = 0, alloc_bytes = 0;
+	unsigned long dropped;
+	FILE * maps;
+	char line[256];
+	int i, j, nsites = 0;
+	
+	// stdio may malloc, and that must not be sampled while we print
+	profile_busy = 1;
+	pthread_mutex_lock(&profile_dump_lock);
+	// copy the sites out, so that no one waits on profile_lock while we print
+	pthread_mutex_lock(&profile_lock);
+	for (i = 0; i < PROFILE_SITES; i++)
+	{
+		live_count += profile_sites[i].live_count;
+		live_bytes += profile_sites[i].live_bytes;
+		alloc_count += profile_sites[i].alloc_count;
+		alloc_bytes += profile_sites[i].alloc_bytes;
+		if (profile_sites[i].depth != 0)
+			profile_snapshot[nsites++] = profile_sites[i];
+	}
+	dropped = profile_dropped;
+	pthread_mutex_unlock(&profile_lock);
+	
+	fprintf(out, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%lu\n", 
+			live_count, live_bytes, alloc_count, alloc_bytes, (unsigned long) PROFILE_RATE);
+	if (dropped)
+		fprintf(out, "# %lu samples dropped, the tables being full\n", dropped);
+	for (i = 0; i < nsites; i++)
+	{
+		profile_site * site = &profile_snapshot[i];
+		
+		fprintf(out, "%lu: %lu [%lu: %lu] @", site->live_count, site->live_bytes, 
+				site->alloc_count, site->alloc_bytes);
+		for (j = 0; j < site->depth; j++)
+			fprintf(out, " 0x%lx", (unsigned long) site->pcs[j]);
+		fprintf(out, "\n");
+		if (site->freed_count)
+			fprintf(out, "# %lu freed after %.6f s on average\n", site->freed_count, 
+					site->lifetime / site->freed_count);
+	}
+	
+	// where the code was loaded, to symbolize the addresses by
+	fprintf(out, "\nMAPPED_LIBRARIES:\n");
+	if ((maps = fopen("/proc/self/maps", "r")) != NULL)
+	{
+		while (fgets(line, sizeof(line), maps) != NULL)
+			fputs(line, out);
+		fclose(maps);
+	}
+	pthread_mutex_unlock(&profile_dump_lock);
+	profile_busy = 0;
+	return 0;
+#else
+	(void) out;
+	return -1;
+#endif
+}
 
+#if MULTI_ARENA
+// which arenas mm_fork_lock holds
+static unsigned char fork_locked[NARENAS];
+#endif
 
+/*
+ * mm_fork_lock - take every lock the allocator has, in the order the rest
+ *  of this file nests them, so that fork copies none of them held by a
+ *  thread that will not exist in the child. An arena made while we wait
+ *  for heap_lock is caught on the next pass; its lock has to come first.
+ */
+void mm_fork_lock(void)
+{
+#if MULTI_ARENA
+	int i, missed;
+#endif
+	
+#if PROFILE
+	pthread_mutex_lock(&profile_dump_lock);
+#endif
+#if MULTI_ARENA
+	pthread_mutex_lock(&handle_lock);
+	memset(fork_locked, 0, sizeof(fork_locked));
+	do
+	{
+		for (i = 0; i < NARENAS; i++)
+			if (arenas[i] != NULL && !fork_locked[i])
+			{
+				LOCK(arenas[i]);
+				fork_locked[i] = 1;
+			}
+		pthread_mutex_lock(&heap_lock);
+		for (i = 0, missed = 0; i < NARENAS; i++)
+			if (arenas[i] != NULL && !fork_locked[i])
+				missed = 1;
+		if (missed)
+			pthread_mutex_unlock(&heap_lock);
+	} while (missed);
+#endif
+#if STATS && MMAP_THRESHOLD
+	pthread_mutex_lock(&map_stats_lock);
+#endif
+#if PROFILE
+	pthread_mutex_lock(&profile_lock);
+#endif
+	mem_fork_lock();
+}
 
+/*
+ * mm_fork_unlock - let go of what mm_fork_lock took, in the parent or the
+ *  child (where the thread that forked is the one holding it all)
+ */
+void mm_fork_unlock(void)
+{
+	mem_fork_unlock();
+#if PROFILE
+	pthread_mutex_unlock(&profile_lock);
+#endif
+#if STATS && MMAP_THRESHOLD
+	pthread_mutex_unlock(&map_stats_lock);
+#endif
+#if MULTI_ARENA
+	int i;
+	
+	pthread_mutex_unlock(&heap_lock);
+	for (i = 0; i < NARENAS; i++)
+		if (fork_locked[i])
+			UNLOCK(arenas[i]);
+	pthread_mutex_unlock(&handle_lock);
+#endif
+#if PROFILE
+	pthread_mutex_unlock(&profile_dump_lock);
+#endif
+}
@@ -4,6 +4,104 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign (size_t alignment, size_t size);
+extern size_t mm_malloc_batch (size_t size, size_t n, void **out);
+extern void mm_free_batch (void **ptrs, size_t n);
+extern void mm_free_sized (void *ptr, size_t size);
+extern size_t mm_usable_size (void *ptr);
+
+/*
+ * mm_free_sized is mm_free for a caller that knows ptr was asked for size
+ * bytes. Only a TCACHE build uses the size, to pick the cache class without
+ * reading the block's header. Other builds ignore it, because freeing a
+ * heap block rewrites its header anyway.
+ */
+
+/*
+ * Counters filled in by mm_stats. Size class i of mallocs and frees holds
+ * the blocks that can take [2^i, 2^(i+1)) bytes. Every field is an
+ * unsigned long.
+ */
+#define MM_SIZE_CLASSES 32
+
+typedef struct {
+    unsigned long mallocs[MM_SIZE_CLASSES]; /* blocks handed out */
+    unsigned long frees[MM_SIZE_CLASSES];   /* blocks given back */
+    unsigned long cache_mallocs;    /* mallocs served by a thread cache */
+    unsigned long cache_frees;      /* frees kept in a thread cache */
+    unsigned long bins_probed;      /* free-list bins find_free looked in */
+    unsigned long nodes_visited;    /* free blocks find_free looked at */
+    unsigned long merges;           /* merge passes (deferred coalescing) */
+    unsigned long blocks_merged;    /* free blocks joined onto a neighbor */
+    unsigned long splits;           /* blocks cut down to size */
+    unsigned long sbrks;            /* times the heap grew */
+    unsigned long sbrk_bytes;       /* bytes it grew by */
+    unsigned long trim_bytes;       /* bytes trimmed back off it */
+    unsigned long maps;             /* requests mapped on their own */
+    unsigned long realloc_in_place; /* reallocs that kept their block */
+    unsigned long realloc_copies;   /* reallocs that had to move */
+    unsigned long live_bytes;       /* usable bytes handed out, not freed */
+    unsigned long peak_live_bytes;  /* most live_bytes has been */
+} mm_stats_t;
+
+extern void mm_stats (mm_stats_t *stats);
+
+/*
+ * mm_profile_dump writes what the sampling heap profiler (a PROFILE=1
+ * build) has seen, as text in the heap_v2 format pprof reads:
+ *
+ *   heap profile: <live n>: <live bytes> [<alloc n>: <alloc bytes>] @ heap_v2/<rate>
+ *   <live n>: <live bytes> [<alloc n>: <alloc bytes>] @ <pc> <pc> ...
+ *   # <n> freed after <seconds> s on average
+ *
+ * with a line per allocation site (the innermost return address first),
+ * followed by "MAPPED_LIBRARIES:" and /proc/self/maps. The counts are of
+ * sampled blocks only; an expected count is each sample of s bytes
+ * weighted by 1 / (1 - exp(-s/rate)). Lines starting with # are comments.
+ * It returns -1 in a build without the profiler.
+ */
+extern int mm_profile_dump (FILE *out);
+
+/*
+ * Movable blocks. mm_halloc returns a handle (0 when out of memory)
+ * instead of a pointer; mm_pin gives the block's address, which holds
+ * until the matching mm_unpin (pins nest). mm_compact slides unpinned
+ * handle blocks down the heap over free space and gives the free space on
+ * top back to memlib, returning how many bytes that was; mm_halloc also
+ * compacts when the heap is full. Blocks from mm_malloc never move. A
+ * MULTI_ARENA build never compacts.
+ */
+typedef unsigned long mm_handle_t;
+
+extern mm_handle_t mm_halloc (size_t size);
+extern void mm_hfree (mm_handle_t handle);
+extern void *mm_pin (mm_handle_t handle);
+extern void mm_unpin (mm_handle_t handle);
+extern size_t mm_compact (void);
+
+/*
+ * Regions, for blocks that all die together. mm_region_alloc bumps a
+ * pointer through chunks the region gets from mm_malloc, so its blocks
+ * cannot be freed (or realloced) one by one; mm_region_reset frees them
+ * all, keeping one chunk to start over in, and mm_region_destroy frees
+ * the region too. A region is not locked: use each from one thread at a
+ * time.
+ */
+typedef struct mm_region mm_region_t;
+
+extern mm_region_t *mm_region_create (void);
+extern void *mm_region_alloc (mm_region_t *region, size_t size);
+extern void mm_region_reset (mm_region_t *region);
+extern void mm_region_destroy (mm_region_t *region);
+
+/*
+ * Around fork, for a program with threads: mm_fork_lock takes every lock
+ * of the allocator (and memlib), and mm_fork_unlock lets them go again in
+ * both the parent and the child. libmm.so hands them to pthread_atfork.
+ */
+extern void mm_fork_lock (void);
+extern void mm_fork_unlock (void);
 
 
 /* 
@@ -0,0 +1,262 @@
+/*
+ * mm_preload.c - the C library's malloc functions on top of mm.c, which
+ *     "make libmm.so" builds into a library that can take the place of
+ *     the process's malloc:
+ *
+ *     unix> LD_PRELOAD=./libmm.so sort big.txt > /dev/null
+ *
+ *     memlib is built with MM_PRELOAD there, so the heap lives in address
+ *     space reserved with mmap. The first call sets it up. Whatever is
+ *     asked for while that is under way (by memlib or the C library, on
+ *     the thread doing it) comes out of a small static buffer, and is
+ *     never freed; other threads wait for the heap.
+ *
+ *     Once the heap is up, pthread_atfork handlers hold every allocator
+ *     lock across fork, so a child forked while another thread is inside
+ *     malloc does not start with that thread's lock taken.
+ *
+ *     In a library built with MMFLAGS=-DPROFILE=1, MM_PROFILE=<file> in
+ *     the environment has the heap profile written to that file at exit:
+ *
+ *     unix> MM_PROFILE=sort.heap LD_PRELOAD=./libmm.so sort big.txt > /dev/null
+ *
+ *     Every other symbol of mm.c and memlib.c is hidden, so none of them
+ *     can take the place of one of the program's own.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <stdio.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define BOOT_SIZE 0x10000
+/* bytes in front of each boot block, which hold its size */
+#define BOOT_HEADER 16
+
+enum { HEAP_NONE, HEAP_STARTING, HEAP_READY };
+
+static int heap_state = HEAP_NONE;
+/* set while this thread is setting up the heap */
+static __thread int heap_starting;
+
+static char boot_buf[BOOT_SIZE] __attribute__((aligned(BOOT_HEADER)));
+static size_t boot_used;
+
+#if PROFILE
+/* where MM_PROFILE says to write the profile at exit, if anywhere */
+static const char *profile_path;
+
+/*
+ * profile_at_exit - write the heap profile to profile_path
+ */
+static void profile_at_exit(void)
+{
+    FILE *out;
+
+    if ((out = fopen(profile_path, "w")) == NULL)
+	return;
+    mm_profile_dump(out);
+    fclose(out);
+}
+#endif
+
+/*
+ * heap_ready - set up the heap if no thread has, or wait for the thread
+ *  that is. Returns 0 when the caller is that thread, which must make do
+ *  with boot_malloc.
+ */
+static int heap_ready(void)
+{
+    int state = HEAP_NONE;
+
+    if (__atomic_load_n(&heap_state, __ATOMIC_ACQUIRE) == HEAP_READY)
+	return 1;
+    if (heap_starting)
+	return 0;
+
+    if (__atomic_compare_exchange_n(&heap_state, &state, HEAP_STARTING, 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	heap_starting = 1;
+	mem_init();
+	if (mm_init() < 0 ||
+	    pthread_atfork(mm_fork_lock, mm_fork_unlock, mm_fork_unlock) != 0)
+	    abort();
+#if PROFILE
+	if ((profile_path = getenv("MM_PROFILE")) != NULL)
+	    atexit(profile_at_exit);
+#endif
+	heap_starting = 0;
+	__atomic_store_n(&heap_state, HEAP_READY, __ATOMIC_RELEASE);
+	return 1;
+    }
+    while (__atomic_load_n(&heap_state, __ATOMIC_ACQUIRE) != HEAP_READY)
+	sched_yield();
+    return 1;
+}
+
+/*
+ * boot_malloc - size bytes from boot_buf, for the thread setting up the heap
+ */
+static void *boot_malloc(size_t size)
+{
+    char *p;
+
+    size = (size + BOOT_HEADER - 1) & ~(size_t)(BOOT_HEADER - 1);
+    if (size > BOOT_SIZE - BOOT_HEADER - boot_used)
+	return NULL;
+    p = boot_buf + boot_used + BOOT_HEADER;
+    *(size_t *)(p - BOOT_HEADER) = size;
+    boot_used += BOOT_HEADER + size;
+    return p;
+}
+
+#define IS_BOOT(ptr) ((char *)(ptr) >= boot_buf && (char *)(ptr) < boot_buf + BOOT_SIZE)
+#define BOOT_USABLE(ptr) (*(size_t *)((char *)(ptr) - BOOT_HEADER))
+
+/*
+ * usable_size - malloc_usable_size of a block from either heap
+ */
+static size_t usable_size(void *ptr)
+{
+    return IS_BOOT(ptr) ? BOOT_USABLE(ptr) : mm_usable_size(ptr);
+}
+
+/*
+ * aligned - the memalign family, for a power-of-two alignment
+ */
+static void *aligned(size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if (size > PTRDIFF_MAX) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    if (!heap_ready())
+	return alignment <= BOOT_HEADER ? boot_malloc(size) : NULL;
+    if ((ptr = mm_memalign(alignment, size)) == NULL)
+	errno = ENOMEM;
+    return ptr;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    void *ptr;
+
+    if (size > PTRDIFF_MAX) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    if (!heap_ready())
+	return boot_malloc(size);
+    if ((ptr = mm_malloc(size)) == NULL)
+	errno = ENOMEM;
+    return ptr;
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr == NULL || IS_BOOT(ptr))
+	return;
+    mm_free(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr;
+
+    if (size != 0 && nmemb > PTRDIFF_MAX / size) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    /*
+     * boot_buf is zero until used, and a boot block is never used twice,
+     * since free ignores boot blocks. If free ever reuses them, this
+     * has to clear the block.
+     */
+    if (!heap_ready())
+	return boot_malloc(nmemb * size);
+    if ((ptr = mm_calloc(nmemb, size)) == NULL)
+	errno = ENOMEM;
+    return ptr;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    void *new_ptr;
+
+    if (ptr == NULL)
+	return malloc(size);
+    if (size == 0) {
+	free(ptr);
+	return NULL;
+    }
+    if (size > PTRDIFF_MAX) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    if (IS_BOOT(ptr)) {
+	/* a boot block never grows in place; move it to the heap */
+	if ((new_ptr = malloc(size)) != NULL)
+	    memcpy(new_ptr, ptr, size < BOOT_USABLE(ptr) ? size : BOOT_USABLE(ptr));
+	return new_ptr;
+    }
+    if ((new_ptr = mm_realloc(ptr, size)) == NULL)
+	errno = ENOMEM;
+    return new_ptr;
+}
+
+EXPORT int posix_memalign(void **out, size_t alignment, size_t size)
+{
+    void *ptr;
+
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+	return EINVAL;
+    if ((ptr = aligned(alignment, size)) == NULL)
+	return ENOMEM;
+    *out = ptr;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    return aligned(alignment, size);
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return aligned(mem_pagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    if (size > PTRDIFF_MAX) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return aligned(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    return ptr == NULL ? 0 : usable_size(ptr);
+}